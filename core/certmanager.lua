@@ -10,6 +10,7 @@ local configmanager = require "prosody.core.configmanager";
 local log = require "prosody.util.logger".init("certmanager");
 local new_config = require"prosody.net.server".tls_builder;
 local tls = require "prosody.net.tls_luasec";
+local timer = require "prosody.util.timer";
 local stat = require "lfs".attributes;
 
 local x509 = require "prosody.util.x509";
@@ -18,12 +19,14 @@ local lfs = require "lfs";
 local tonumber, tostring = tonumber, tostring;
 local pairs = pairs;
 local t_remove = table.remove;
+local t_concat = table.concat;
 local type = type;
 local io_open = io.open;
 local select = select;
 local now = os.time;
 local next = next;
 local pcall = pcall;
+local require = require;
 
 local prosody = prosody;
 local pathutil = require"prosody.util.paths";
@@ -38,6 +41,58 @@ local global_ssl_config = configmanager.get("*", "ssl");
 
 local global_certificates = configmanager.get("*", "certificates") or "certs";
 
+-- TLS session resumption, shared by all contexts
+local session_cache_size, session_timeout, session_tickets, ticket_key_rotation, kernel_offload;
+
+local function load_session_config()
+	session_cache_size = tonumber(configmanager.get("*", "tls_session_cache_size")) or 20480;
+	session_timeout = tonumber(configmanager.get("*", "tls_session_timeout")) or 3600;
+	session_tickets = configmanager.get("*", "tls_session_tickets") ~= false;
+	-- Tickets stay valid for between one and two rotation periods
+	ticket_key_rotation = tonumber(configmanager.get("*", "tls_ticket_key_rotation")) or 3600;
+	tls.set_session_cache_size(session_cache_size);
+	-- OpenSSL falls back to doing it itself if the kernel lacks kTLS support
+	kernel_offload = configmanager.get("*", "tls_kernel_offload") == true;
+	if kernel_offload and not tls.have_ktls then
+		log("warn", "tls_kernel_offload is enabled but not supported by this build of OpenSSL or Prosody");
+		kernel_offload = false;
+	end
+end
+
+load_session_config();
+
+if tls.have_session_cache then
+	tls.rotate_ticket_keys();
+	timer.add_task(ticket_key_rotation, function ()
+		local ok, err = tls.rotate_ticket_keys();
+		if ok then
+			log("debug", "Rotated TLS session ticket keys");
+		else
+			log("error", "Failed to rotate TLS session ticket keys: %s", err);
+		end
+		return ticket_key_rotation;
+	end);
+end
+
+local m_handshakes, m_cached_sessions, m_ktls;
+prosody.events.add_handler("stats-update", function ()
+	local stats = tls.session_stats();
+	if not stats then return; end
+	if not m_handshakes then
+		local statsmanager = require "prosody.core.statsmanager";
+		m_handshakes = statsmanager.metric("counter", "prosody_tls_handshakes", "", "Completed TLS handshakes", { "mode", "type" });
+		m_cached_sessions = statsmanager.metric("gauge", "prosody_tls_cached_sessions", "", "Sessions in the shared TLS session cache", {}):with_labels();
+		m_ktls = statsmanager.metric("counter", "prosody_tls_ktls_handshakes", "", "TLS handshakes after which the kernel handles encryption", { "direction" });
+	end
+	m_handshakes:with_labels("server", "full"):set(stats.server_full);
+	m_handshakes:with_labels("server", "resumed"):set(stats.server_resumed);
+	m_handshakes:with_labels("client", "full"):set(stats.client_full);
+	m_handshakes:with_labels("client", "resumed"):set(stats.client_resumed);
+	m_cached_sessions:set(stats.cached);
+	m_ktls:with_labels("send"):set(stats.ktls_send);
+	m_ktls:with_labels("receive"):set(stats.ktls_recv);
+end);
+
 local crt_try = { "", "/%s.crt", "/%s/fullchain.pem", "/%s.pem", };
 local key_try = { "", "/%s.key", "/%s/privkey.pem",   "/%s.pem", };
 
@@ -344,6 +399,25 @@ local function create_context(host, mode, ...)
 
 	local ctx, err = cfg:build();
 
+	if ctx and tls.have_session_cache then
+		local verify = user_ssl_config.verify;
+		if type(verify) == "table" then
+			verify = t_concat(verify, ",");
+		end
+		local ok, session_err = ctx:set_session_options({
+			-- Sessions are only resumed in an equivalent context
+			id = mode.." "..host.." "..tostring(user_ssl_config.certificate).." "..tostring(verify);
+			server = mode == "server";
+			cache = session_cache_size > 0;
+			tickets = session_tickets;
+			timeout = session_timeout;
+			ktls = kernel_offload;
+		});
+		if not ok then
+			log("warn", "Could not set up TLS session resumption for %s: %s", host, session_err);
+		end
+	end
+
 	if not ctx then
 		err = err or "invalid ssl config"
 		local file = err:match("^error loading (.-) %(");
@@ -392,6 +466,7 @@ local function reload_ssl_config()
 		core_defaults.dane = true;
 	end
 	cert_index = index_certs(resolve_path(config_path, global_certificates));
+	load_session_config();
 end
 
 prosody.events.add_handler("config-reloaded", reload_ssl_config);
@@ -14,7 +14,11 @@ local log = require "prosody.util.logger".init("rostermanager");
 local new_id = require "prosody.util.id".short;
 local new_cache = require "prosody.util.cache".new;
 
-local pairs = pairs;
+local pairs, ipairs = pairs, ipairs;
+local next = next;
+local os_time = os.time;
+local setmetatable = setmetatable;
+local t_concat, t_sort = table.concat, table.sort;
 local tostring = tostring;
 local type = type;
 
@@ -22,6 +26,8 @@ local hosts = prosody.hosts;
 local bare_sessions = prosody.bare_sessions;
 
 local um_user_exists = require "prosody.core.usermanager".user_exists;
+local um_users = require "prosody.core.usermanager".users;
+local config = require "prosody.core.configmanager";
 local st = require "prosody.util.stanza";
 local storagemanager = require "prosody.core.storagemanager";
 
@@ -30,8 +36,44 @@ local _ENV = nil;
 
 local save_roster; -- forward declaration
 
+-- Most roster items have no groups or one of a few, often the same across
+-- every user on the server (e.g. with mod_groups), so identical group sets
+-- are shared rather than every item having its own table. Shared sets must
+-- be replaced, never modified in place.
+local group_sets = setmetatable({}, { __mode = "v" });
+
+local function intern_groups(groups)
+	if type(groups) ~= "table" then
+		return groups;
+	end
+	local names = {};
+	for group in pairs(groups) do
+		names[#names+1] = group;
+	end
+	t_sort(names);
+	local key = t_concat(names, "\0");
+	local shared = group_sets[key];
+	if not shared then
+		shared = {};
+		for _, group in ipairs(names) do
+			shared[group] = true;
+		end
+		group_sets[key] = shared;
+	end
+	return shared;
+end
+
+local function intern_roster_groups(roster)
+	for jid, item in pairs(roster) do
+		if jid and type(item) == "table" then
+			item.groups = intern_groups(item.groups);
+		end
+	end
+end
+
 local function add_to_roster(session, jid, item)
 	if session.roster then
+		item.groups = intern_groups(item.groups);
 		local old_item = session.roster[jid];
 		session.roster[jid] = item;
 		if save_roster(session.username, session.host, nil, jid) then
@@ -60,23 +102,27 @@ local function remove_from_roster(session, jid)
 	end
 end
 
+local function roster_push_stanza(roster, jid, version)
+	local item = roster[jid];
+	local stanza = st.iq({type="set", id=new_id()});
+	stanza:tag("query", {xmlns = "jabber:iq:roster", ver = tostring(version or roster[false].version or "1")  });
+	if item then
+		stanza:tag("item", {jid = jid, subscription = item.subscription, name = item.name, ask = item.ask});
+		for group in pairs(item.groups) do
+			stanza:tag("group"):text(group):up();
+		end
+	else
+		stanza:tag("item", {jid = jid, subscription = "remove"});
+	end
+	stanza:up(); -- move out from item
+	stanza:up(); -- move out from stanza
+	return stanza;
+end
+
 local function roster_push(username, host, jid)
 	local roster = jid and hosts[host] and hosts[host].sessions[username] and hosts[host].sessions[username].roster;
 	if roster then
-		local item = hosts[host].sessions[username].roster[jid];
-		local stanza = st.iq({type="set", id=new_id()});
-		stanza:tag("query", {xmlns = "jabber:iq:roster", ver = tostring(roster[false].version or "1")  });
-		if item then
-			stanza:tag("item", {jid = jid, subscription = item.subscription, name = item.name, ask = item.ask});
-			for group in pairs(item.groups) do
-				stanza:tag("group"):text(group):up();
-			end
-		else
-			stanza:tag("item", {jid = jid, subscription = "remove"});
-		end
-		stanza:up(); -- move out from item
-		stanza:up(); -- move out from stanza
-		-- stanza ready
+		local stanza = roster_push_stanza(roster, jid);
 		for _, session in pairs(hosts[host].sessions[username].sessions) do
 			if session.interested then
 				session.send(stanza);
@@ -152,6 +198,8 @@ local function load_roster(username, host)
 	if not err then
 		hosts[host].events.fire_event("roster-load", { username = username, host = host, roster = roster });
 	end
+	-- After roster-load, which may add groups
+	intern_roster_groups(roster);
 	if roster_cache and not user then
 		log("debug", "load_roster: caching loaded roster");
 		roster_cache:set(jid, roster);
@@ -159,6 +207,297 @@ local function load_roster(username, host)
 	return roster, err;
 end
 
+-- Reverse index from contact JID to the set of local users who have given
+-- that contact a presence subscription ("from" or "both"), so answering
+-- is_contact_subscribed() for offline users doesn't mean loading their
+-- roster. Kept in storage, with recently used entries cached in memory.
+-- It is built once in the background (see build_subscriber_index()) and
+-- not used before that, nor on hosts where rosters are modified as they
+-- are loaded (e.g. by mod_groups), since those contacts are never saved.
+--
+-- Each build goes into a store of its own, named after its generation, so
+-- that nothing left over from an earlier index can survive a rebuild. The
+-- status record ({ generation, built }) lives in "roster_subscribers".
+local function subscriber_index(host)
+	local host_session = hosts[host];
+	if not host_session then
+		return nil;
+	end
+	local index = host_session.roster_subscriber_index;
+	if index == nil then
+		local status_store = storagemanager.open(host, "roster_subscribers", "keyval");
+		if config.get(host, "roster_subscriber_index") == false then
+			-- Changes won't be indexed, so it has to be built again if re-enabled
+			local status = status_store:get(nil);
+			if status and status.built then
+				status_store:set(nil, { generation = status.generation });
+			end
+			index = false;
+		else
+			index = {
+				status_store = status_store;
+				cache = new_cache(config.get(host, "roster_subscriber_cache_size") or 10000);
+			};
+		end
+		host_session.roster_subscriber_index = index;
+	end
+	return index or nil;
+end
+
+local function use_generation(index, host, generation)
+	index.generation = generation;
+	index.store = storagemanager.open(host, "roster_subscribers_"..generation, "keyval");
+	index.cache:clear();
+end
+
+local function get_subscribers(host, contact)
+	local index = subscriber_index(host);
+	if not index or not index.store then
+		return nil, "index not available";
+	end
+	local subscribers = index.cache:get(contact);
+	if subscribers == nil then
+		local err;
+		subscribers, err = index.store:get(contact);
+		if err then
+			return nil, err;
+		end
+		subscribers = subscribers or {};
+		index.cache:set(contact, subscribers);
+	end
+	return subscribers;
+end
+
+local function set_subscribed(index, username, host, contact, item)
+	if index.broken then
+		return;
+	end
+	local subscribed = nil;
+	if item and item.persist ~= false and (item.subscription == "from" or item.subscription == "both") then
+		subscribed = true;
+	end
+	local subscribers, err = get_subscribers(host, contact);
+	if subscribers and subscribers[username] ~= subscribed then
+		subscribers[username] = subscribed;
+		local ok;
+		if next(subscribers) == nil then
+			ok, err = index.store:set(contact, nil);
+		else
+			ok, err = index.store:set(contact, subscribers);
+		end
+		if ok then
+			return;
+		end
+	elseif subscribers then
+		return;
+	end
+	-- Better not to use it at all than to give wrong answers
+	log("error", "Could not update roster subscriber index for %s: %s", host, err);
+	index.broken = true;
+	index.cache:clear();
+	index.status_store:set(nil, { generation = index.generation }); -- Rebuild on next start
+end
+
+local function update_subscriber_index(username, host, contact, item)
+	local index = subscriber_index(host);
+	if not index then
+		return;
+	end
+	if index.building then
+		-- Tell the build that what it read for this user may be outdated
+		index.building[username] = true;
+	end
+	if not index.store then
+		-- Not built yet, the build will read the saved roster
+		return;
+	end
+	set_subscribed(index, username, host, contact, item);
+end
+
+local function index_roster(username, host, roster)
+	for contact, item in pairs(roster) do
+		if contact then
+			update_subscriber_index(username, host, contact, item);
+		end
+	end
+end
+
+-- Returns whether the contact is subscribed to the user, or nil if the
+-- index can't answer that
+local function indexed_subscription(username, host, contact)
+	local index = subscriber_index(host);
+	if not index or index.broken or hosts[host].events.get_handlers("roster-load") then
+		return nil;
+	end
+	if index.ready == nil then
+		local status = index.status_store:get(nil);
+		index.ready = not not (status and status.built and status.generation);
+		if index.ready then
+			use_generation(index, host, status.generation);
+		end
+	end
+	if not index.ready then
+		return nil;
+	end
+	local subscribers = get_subscribers(host, contact);
+	if not subscribers then
+		return nil;
+	end
+	return subscribers[username] == true;
+end
+
+-- Removes what is left of an index that is no longer used
+local function purge_generation(host, generation)
+	local store = storagemanager.open(host, "roster_subscribers_"..generation, "keyval");
+	if not store.users then
+		return;
+	end
+	local contacts = {};
+	for contact in store:users() do
+		contacts[#contacts+1] = contact;
+	end
+	for _, contact in ipairs(contacts) do
+		store:set(contact, nil);
+	end
+end
+
+-- Indexes the stored rosters of all users. Needs to run in an async context,
+-- changes made meanwhile are indexed as usual.
+local function build_subscriber_index(host)
+	local index = subscriber_index(host);
+	if not index then
+		return nil, "host not found";
+	end
+	local status, err = index.status_store:get(nil);
+	if err then
+		return nil, err;
+	end
+	if status and status.built and status.generation then
+		use_generation(index, host, status.generation);
+		index.ready = true;
+		return true;
+	end
+	log("info", "Building roster subscriber index for %s", host);
+	local user_iter = um_users(host);
+	if not user_iter then
+		return nil, "user listing not supported";
+	end
+	local previous = status and status.generation;
+	if previous then
+		purge_generation(host, previous);
+	end
+	local generation = os_time();
+	if generation == previous then
+		generation = generation + 1;
+	end
+	local ok;
+	ok, err = index.status_store:set(nil, { generation = generation });
+	if not ok then
+		return nil, err;
+	end
+	index.broken = nil;
+	use_generation(index, host, generation);
+
+	index.building = {};
+	local roster_store = storagemanager.open(host, "roster", "keyval");
+	local count = 0;
+	for username in user_iter do
+		-- Contacts indexed for this user so far
+		local indexed = {};
+		repeat
+			index.building[username] = nil;
+			local roster;
+			roster, err = roster_store:get(username);
+			if err then
+				index.building = nil;
+				return nil, err;
+			end
+			roster = roster or {};
+			-- The roster was saved while it was being read or indexed, so
+			-- index it again, undoing anything from the outdated copy
+			for contact in pairs(indexed) do
+				if roster[contact] == nil then
+					set_subscribed(index, username, host, contact, nil);
+				end
+			end
+			for contact, item in pairs(roster) do
+				if contact then
+					indexed[contact] = true;
+					set_subscribed(index, username, host, contact, item);
+				end
+			end
+		until not index.building[username];
+		if next(indexed) then
+			count = count + 1;
+		end
+	end
+	index.building = nil;
+	if index.broken then
+		return nil, "could not update index";
+	end
+	ok, err = index.status_store:set(nil, { built = os_time(); generation = generation });
+	if not ok then
+		return nil, err;
+	end
+	index.ready = true;
+	log("info", "Indexed rosters of %d users on %s", count, host);
+	return true;
+end
+
+-- The roster version each contact last changed in, so that clients with an
+-- older version can be sent just the changes (RFC 6121 section 2.6.3).
+-- Kept in the metadata, bounded by roster_version_history, with
+-- changes_since being the oldest version that can still be caught up from.
+local function record_change(host, metadata, jid)
+	local version = metadata.version;
+	local changes = metadata.changes;
+	if jid == nil or not changes or metadata.changes_version ~= version - 1 then
+		-- Whole roster saved, or the version changed behind our back
+		changes = {};
+		metadata.changes = changes;
+		metadata.changes_since = jid == nil and version or version - 1;
+	end
+	metadata.changes_version = version;
+	if jid == nil then
+		return;
+	end
+	changes[jid] = version;
+
+	local limit = config.get(host, "roster_version_history") or 100;
+	local count, oldest_jid, oldest_version = 0, nil, nil;
+	for changed_jid, changed_in in pairs(changes) do
+		count = count + 1;
+		if not oldest_version or changed_in < oldest_version then
+			oldest_jid, oldest_version = changed_jid, changed_in;
+		end
+	end
+	if count > limit then
+		changes[oldest_jid] = nil;
+		metadata.changes_since = oldest_version;
+	end
+end
+
+-- Returns the contacts changed since the given version, in the order they
+-- were changed, or nil if the roster must be sent in full
+local function get_changes(roster, version)
+	local metadata = roster[false];
+	local changes = metadata and metadata.changes;
+	if not changes or type(metadata.version) ~= "number" or metadata.changes_version ~= metadata.version
+	or version < metadata.changes_since or version > metadata.version then
+		return nil;
+	end
+	local changed = {};
+	for jid, changed_in in pairs(changes) do
+		if changed_in > version then
+			changed[#changed+1] = jid;
+		end
+	end
+	t_sort(changed, function (a, b)
+		return changes[a] < changes[b];
+	end);
+	return changed;
+end
+
 function save_roster(username, host, roster, jid)
 	if not um_user_exists(username, host) then
 		log("debug", "not saving roster for %s@%s: the user doesn't exist", username, host);
@@ -177,15 +516,24 @@ function save_roster(username, host, roster, jid)
 		local metadata = roster_metadata(roster);
 		if metadata.version ~= true then
 			metadata.version = (metadata.version or 0) + 1;
+			record_change(host, metadata, jid);
 		end
 		if metadata.broken then return nil, "Not saving broken roster" end
+		local ok, err;
 		if jid == nil then
 			local roster_store = storagemanager.open(host, "roster", "keyval");
-			return roster_store:set(username, roster);
+			ok, err = roster_store:set(username, roster);
+			if ok then
+				index_roster(username, host, roster);
+			end
 		else
 			local roster_store = storagemanager.open(host, "roster", "map");
-			return roster_store:set_keys(username, { [false] = metadata, [jid] = roster[jid] or roster_store.remove });
+			ok, err = roster_store:set_keys(username, { [false] = metadata, [jid] = roster[jid] or roster_store.remove });
+			if ok then
+				update_subscriber_index(username, host, jid, roster[jid]);
+			end
 		end
+		return ok, err;
 	end
 	log("warn", "save_roster: user had no roster to save");
 	return nil;
@@ -266,6 +614,10 @@ local function is_contact_subscribed(username, host, jid)
 		local contact_subscription = _get_online_roster_subscription(jid, selfjid);
 		if contact_subscription then return (contact_subscription == "both" or contact_subscription == "to"); end
 	end
+	local indexed = indexed_subscription(username, host, jid);
+	if indexed ~= nil then
+		return indexed;
+	end
 	local roster, err = load_roster(username, host);
 	local item = roster[jid];
 	return item and (item.subscription == "from" or item.subscription == "both"), err;
@@ -408,7 +760,13 @@ return {
 	add_to_roster = add_to_roster;
 	remove_from_roster = remove_from_roster;
 	roster_push = roster_push;
+	roster_push_stanza = roster_push_stanza;
+	get_changes = get_changes;
+	get_subscribers = get_subscribers;
+	update_subscriber_index = update_subscriber_index;
+	build_subscriber_index = build_subscriber_index;
 	load_roster = load_roster;
+	intern_groups = intern_groups;
 	save_roster = save_roster;
 	process_inbound_subscription_approval = process_inbound_subscription_approval;
 	process_inbound_subscription_cancellation = process_inbound_subscription_cancellation;
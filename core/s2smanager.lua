@@ -37,7 +37,9 @@ local function new_incoming(conn)
 	return host_session;
 end
 
-local function new_outgoing(from_host, to_host)
+-- Extra streams opened in parallel to an existing one are not registered
+-- as the route to the remote domain
+local function new_outgoing(from_host, to_host, extra_stream)
 	local host_session = sessionlib.new("s2sout");
 	sessionlib.set_id(host_session);
 	sessionlib.set_logger(host_session);
@@ -48,7 +50,9 @@ local function new_outgoing(from_host, to_host)
 	host_session.direction = "outgoing";
 	host_session.outgoing = true;
 	host_session.hosts = {};
-	hosts[from_host].s2sout[to_host] = host_session;
+	if not extra_stream then
+		hosts[from_host].s2sout[to_host] = host_session;
+	end
 	return host_session;
 end
 
@@ -91,7 +95,9 @@ local function destroy_session(session, reason, bounce_reason)
 	log("debug", "Destroying %s session %s->%s%s%s", session.direction, session.from_host, session.to_host, reason and ": " or "", reason or "");
 
 	if session.direction == "outgoing" then
-		hosts[session.from_host].s2sout[session.to_host] = nil;
+		if hosts[session.from_host].s2sout[session.to_host] == session then
+			hosts[session.from_host].s2sout[session.to_host] = nil;
+		end
 		session:bounce_sendq(bounce_reason or reason);
 	elseif session.direction == "incoming" then
 		if session.outgoing and hosts[session.to_host].s2sout[session.from_host] == session then
@@ -1,5 +1,5 @@
 
-local type, pairs = type, pairs;
+local type, pairs, ipairs = type, pairs, ipairs;
 local setmetatable = setmetatable;
 local rawset = rawset;
 
@@ -117,6 +117,43 @@ local function get_driver(host, store)
 	return driver, driver_name;
 end
 
+-- Generic versions of the bulk methods, for drivers that don't provide their own
+
+local function keyval_get_many(self, usernames)
+	local results = {};
+	for _, username in ipairs(usernames) do
+		local data, err = self:get(username);
+		if data == nil and err then
+			return nil, err;
+		end
+		results[username] = data;
+	end
+	return results;
+end
+
+local function map_get_many(self, usernames, key)
+	local results = {};
+	for _, username in ipairs(usernames) do
+		local data, err = self:get(username, key);
+		if data == nil and err then
+			return nil, err;
+		end
+		results[username] = data;
+	end
+	return results;
+end
+
+local function add_bulk_methods(store, typ)
+	if store.get_many == nil then
+		if typ == nil or typ == "keyval" then
+			rawset(store, "get_many", keyval_get_many);
+		elseif typ == "map" then
+			rawset(store, "get_many", map_get_many);
+		end
+	end
+	return store;
+end
+
 local map_shim_mt = {
 	__index = {
 		get = function(self, username, key)
@@ -124,6 +161,14 @@ local map_shim_mt = {
 			if ret == nil then return nil, err end
 			return ret[key];
 		end;
+		get_many = function(self, usernames, key)
+			local ret, err = self.keyval_store:get_many(usernames);
+			if ret == nil then return nil, err end
+			for username, data in pairs(ret) do
+				ret[username] = data[key];
+			end
+			return ret;
+		end;
 		set = function(self, username, key, data)
 			local current, err = self.keyval_store:get(username);
 			if current == nil then
@@ -193,6 +238,9 @@ local combined_store_mt = {
 		get = function (self, name)
 			return self.keyval_store:get(name);
 		end;
+		get_many = function (self, names)
+			return self.keyval_store:get_many(names);
+		end;
 		set = function (self, name, data)
 			return self.keyval_store:set(name, data);
 		end;
@@ -203,6 +251,9 @@ local combined_store_mt = {
 		get_key = function (self, name, key)
 			return self.map_store:get(name, key);
 		end;
+		get_key_from_many = function (self, names, key)
+			return self.map_store:get_many(names, key);
+		end;
 		set_key = function (self, name, key, value)
 			return self.map_store:set(name, key, value);
 		end;
@@ -258,8 +309,8 @@ local function open_combined(host, store)
 		return nil, err;
 	end
 	local combined_store = setmetatable({
-		keyval_store = keyval_store;
-		map_store = map_store;
+		keyval_store = add_bulk_methods(keyval_store, "keyval");
+		map_store = add_bulk_methods(map_store, "map");
 		remove = map_store.remove;
 	}, combined_store_mt);
 	local event_data = { host = host, store_name = store, store_type = "keyval+", store = combined_store };
@@ -286,6 +337,7 @@ function open(host, store, typ)
 		end
 	end
 	if ret then
+		add_bulk_methods(ret, typ);
 		local event_data = { host = host, store_name = store, store_type = typ, store = ret };
 		hosts[host].events.fire_event("store-opened", event_data);
 		ret, err = event_data.store, event_data.store_err;
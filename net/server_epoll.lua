@@ -19,6 +19,7 @@ local socket = require "socket";
 local realtime = require "prosody.util.time".now;
 local monotonic = require "prosody.util.time".monotonic;
 local indexedbheap = require "prosody.util.indexedbheap";
+local have_timerwheel, timerwheel = pcall(require, "prosody.util.timerwheel");
 local createtable = require "prosody.util.table".create;
 local dbuffer = require "prosody.util.dbuffer";
 local inet = require "prosody.util.net";
@@ -105,6 +106,12 @@ local default_config = { __index = {
 	-- Timeout used during between steps in TLS handshakes
 	ssl_handshake_timeout = 60;
 
+	-- Share of each interval that TLS handshakes may spend, after which more
+	-- handshake steps wait for the next interval so that established
+	-- connections keep being served during reconnect storms. false to disable.
+	tls_handshake_budget = 0.5;
+	tls_handshake_budget_interval = 0.1;
+
 	-- Maximum and minimum amount of time to sleep waiting for events (adjusted for pending timers)
 	max_wait = 86400;
 	min_wait = 0.001;
@@ -137,6 +144,10 @@ local default_config = { __index = {
 	-- TCP Fast Open
 	tcp_fastopen = false;
 
+	-- Resolution in seconds of the timing wheel used for read and write
+	-- timeouts, or false to keep them in the same heap as other timers
+	timer_wheel_resolution = 1;
+
 	-- Defer accept until incoming data is available
 	tcp_defer_accept = false;
 }};
@@ -150,18 +161,44 @@ local timers = indexedbheap.create();
 
 local function noop() end
 
+-- Connection timeouts are rescheduled on nearly every read or write, so
+-- when available they go in a timing wheel where that is O(1) instead of
+-- O(log n). Their ids are negated wheel handles to tell them apart.
+local wheel = nil;
+local wheeltimers = {};
+
+-- While expired wheel timers are being run, handles are only released once
+-- all of them have been, so that a handle can't be reused by a new timer
+-- and then be run from the same batch
+local wheel_released = nil;
+
 -- Keep track of recently closed timers to avoid re-adding them
 local closedtimers = {};
 
 local function closetimer(id)
-	if timers:remove(id) then
+	if id < 0 then
+		local handle = -id;
+		if wheeltimers[handle] == nil then
+			return;
+		end
+		wheeltimers[handle] = nil;
+		if wheel_released then
+			wheel_released[#wheel_released+1] = handle;
+		else
+			wheel:remove(handle);
+		end
+	elseif timers:remove(id) then
 		closedtimers[id] = true;
 	end
 end
 
 local function reschedule(id, time)
 	time = monotonic() + time;
-	timers:reprioritize(id, time);
+	if id < 0 then
+		wheel:reschedule(-id, time);
+	else
+		timers:reprioritize(id, time);
+	end
 end
 
 -- Add relative timer
@@ -178,12 +215,58 @@ local function addtimer(timeout, f, param)
 	return id;
 end
 
+-- Add relative timer for a timeout that may fire up to timer_wheel_resolution late
+local function addcoarsetimer(timeout, f)
+	if not (have_timerwheel and cfg.timer_wheel_resolution) then
+		return addtimer(timeout, f);
+	end
+	if not wheel then
+		wheel = timerwheel.new(cfg.timer_wheel_resolution, monotonic());
+	end
+	local handle = wheel:add(monotonic() + timeout);
+	wheeltimers[handle] = f;
+	return -handle;
+end
+
+local function runwheeltimers(elapsed, now)
+	local expired = wheel:advance(elapsed);
+	if not expired then return end
+	local released = {};
+	wheel_released = released;
+	for _, handle in ipairs(expired) do
+		local f = wheeltimers[handle];
+		-- Skip timers closed by an earlier callback
+		if f then
+			local ok, ret = xpcall(f, traceback, now, -handle);
+			-- Unless closed by the callback, re-arm or release it
+			if wheeltimers[handle] then
+				if ok and type(ret) == "number" then
+					wheel:reschedule(handle, elapsed + ret);
+				else
+					wheeltimers[handle] = nil;
+					released[#released+1] = handle;
+				end
+			end
+			if not ok then
+				log("error", "Error in timer: %s", ret);
+			end
+		end
+	end
+	wheel_released = nil;
+	for _, handle in ipairs(released) do
+		wheel:remove(handle);
+	end
+end
+
 -- Run callbacks of expired timers
 -- Return time until next timeout
 local function runtimers(next_delay, min_wait)
 	-- Any timers at all?
 	local elapsed = monotonic();
 	local now = realtime();
+	if wheel then
+		runwheeltimers(elapsed, now);
+	end
 	local peek = timers:peek();
 	local readd;
 	while peek do
@@ -221,6 +304,11 @@ local function runtimers(next_delay, min_wait)
 		closedtimers = {};
 	end
 
+	local wheel_peek = wheel and wheel:next_expiry();
+	if wheel_peek and (peek == nil or wheel_peek < peek) then
+		peek = wheel_peek;
+	end
+
 	if peek == nil then
 		return next_delay;
 	else
@@ -378,7 +466,7 @@ function interface:setreadtimeout(t)
 	if self._readtimeout then
 		reschedule(self._readtimeout, t);
 	else
-		self._readtimeout = addtimer(t, function ()
+		self._readtimeout = addcoarsetimer(t, function ()
 			if self:on("readtimeout") then
 				self:noise("Read timeout handled");
 				return cfg.read_timeout;
@@ -404,7 +492,7 @@ function interface:setwritetimeout(t)
 	if self._writetimeout then
 		reschedule(self._writetimeout, t);
 	else
-		self._writetimeout = addtimer(t, function ()
+		self._writetimeout = addcoarsetimer(t, function ()
 			self:noise("Write timeout");
 			self:on("disconnect", self._connected and "write timeout" or "connection timeout");
 			self:destroy();
@@ -824,10 +912,54 @@ function interface:inittls(tls_ctx, now)
 	self:set(true, true);
 end
 
+-- Pacing of TLS handshakes
+local handshake_time = 0; -- Time spent on handshakes in the current interval
+local handshake_interval_start = 0;
+local deferred_handshakes = {};
+local handshake_resume_timer;
+
+local function handshake_over_budget(now)
+	if now - handshake_interval_start >= cfg.tls_handshake_budget_interval then
+		handshake_interval_start, handshake_time = now, 0;
+		return false;
+	end
+	return handshake_time >= cfg.tls_handshake_budget * cfg.tls_handshake_budget_interval;
+end
+
+local function resume_handshakes()
+	handshake_resume_timer = nil;
+	local resuming = deferred_handshakes;
+	deferred_handshakes = {};
+	for _, conn in ipairs(resuming) do
+		conn._handshake_deferred = nil;
+		-- Unless it was closed in the meantime
+		if conn.onreadable == interface.tlshandshake then
+			conn:tlshandshake();
+		end
+	end
+end
+
+function interface:deferhandshake(now)
+	self:set(false, false);
+	if self._handshake_deferred then return end
+	self:noise("Deferring TLS handshake");
+	self._handshake_deferred = true;
+	deferred_handshakes[#deferred_handshakes+1] = self;
+	if not handshake_resume_timer then
+		local delay = cfg.tls_handshake_budget_interval - (now - handshake_interval_start);
+		handshake_resume_timer = addtimer(delay, resume_handshakes);
+	end
+end
+
 function interface:tlshandshake()
 	self:setreadtimeout(false);
+	local start = monotonic();
+	if cfg.tls_handshake_budget and handshake_over_budget(start) then
+		return self:deferhandshake(start);
+	end
 	self:noise("Continuing TLS handshake");
 	local ok, err = self.conn:dohandshake();
+	handshake_time = handshake_time + (monotonic() - start);
 	if ok then
 		local info = self.conn.info and self.conn:info();
 		if type(info) == "table" then
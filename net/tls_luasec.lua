@@ -18,8 +18,10 @@ instead of having to mimic LuaSec.
 ]]
 local ssl = require "ssl";
 local ssl_newcontext = ssl.newcontext;
+local sha256 = require "prosody.util.hashes".sha256;
 local ssl_context = ssl.context or require "ssl.context";
 local io_open = io.open;
+local have_tlscache, tlscache = pcall(require, "prosody.util.tlscache");
 
 local context_api = {};
 local context_mt = {__index = context_api};
@@ -33,11 +35,38 @@ function context_api:set_sni_host(host, cert, key)
 		return false, err
 	end
 
+	if self._session_options then
+		ctx:set_session_options(self._session_options, host);
+	end
+
 	self._sni_contexts[host] = ctx._inner
 
 	return true, nil
 end
 
+-- Resumption via the shared session cache and ticket keys. Sessions are
+-- only resumed in contexts with the same id.
+function context_api:set_session_options(options, sni_host)
+	if not have_tlscache then
+		return false, "session cache support not available";
+	end
+	if not sni_host then
+		self._session_options = options;
+	end
+	local id = options.id;
+	if sni_host then
+		id = id .. "\0" .. sni_host;
+	end
+	return tlscache.configure(self._inner, {
+		id = sha256(id);
+		server = options.server;
+		cache = options.cache;
+		tickets = options.tickets;
+		timeout = options.timeout;
+		ktls = options.ktls;
+	});
+end
+
 function context_api:remove_sni_host(host)
 	self._sni_contexts[host] = nil
 end
@@ -110,8 +139,30 @@ local luasec_has = ssl.config or {
 	};
 };
 
+local function set_session_cache_size(size)
+	if have_tlscache then
+		tlscache.set_size(size);
+	end
+end
+
+local function rotate_ticket_keys()
+	if not have_tlscache then
+		return false, "session cache support not available";
+	end
+	return tlscache.rotate_ticket_keys();
+end
+
+local function session_stats()
+	return have_tlscache and tlscache.stats() or nil;
+end
+
 return {
 	features = luasec_has;
+	have_session_cache = have_tlscache;
+	have_ktls = have_tlscache and tlscache.have_ktls;
+	set_session_cache_size = set_session_cache_size;
+	rotate_ticket_keys = rotate_ticket_keys;
+	session_stats = session_stats;
 	new_context = new_context,
 	load_certificate = ssl.loadcertificate;
 };
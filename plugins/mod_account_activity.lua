@@ -66,19 +66,45 @@ module:add_item("shell-command", {
 		local now = os.time();
 		local n_inactive, n_unknown = 0, 0;
 
-		for username in um.users(host) do
-			local last_active = store:get_key(username, "timestamp");
-			if not last_active then
-				local created_at = um.get_account_info(username, host).created;
-				if created_at and (now - created_at) > duration_sec then
-					self.session.print(username, "");
+		local function check_batch(usernames)
+			local timestamps, err = store:get_key_from_many(usernames, "timestamp");
+			if not timestamps then
+				return nil, err;
+			end
+			for _, username in ipairs(usernames) do
+				local last_active = timestamps[username];
+				if not last_active then
+					local created_at = um.get_account_info(username, host).created;
+					if created_at and (now - created_at) > duration_sec then
+						self.session.print(username, "");
+						n_inactive = n_inactive + 1;
+					elseif not created_at then
+						n_unknown = n_unknown + 1;
+					end
+				elseif (now - last_active) > duration_sec then
+					self.session.print(username, os.date("%Y-%m-%dT%T", last_active));
 					n_inactive = n_inactive + 1;
-				elseif not created_at then
-					n_unknown = n_unknown + 1;
 				end
-			elseif (now - last_active) > duration_sec then
-				self.session.print(username, os.date("%Y-%m-%dT%T", last_active));
-				n_inactive = n_inactive + 1;
+			end
+			return true;
+		end
+
+		-- Look up activity in batches rather than one query per account
+		local batch = {};
+		for username in um.users(host) do
+			batch[#batch+1] = username;
+			if #batch == 100 then
+				local ok, err = check_batch(batch);
+				if not ok then
+					return false, err;
+				end
+				batch = {};
+			end
+		end
+		if batch[1] then
+			local ok, err = check_batch(batch);
+			if not ok then
+				return false, err;
 			end
 		end
 
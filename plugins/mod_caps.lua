@@ -0,0 +1,264 @@
+-- Entity Capabilities (XEP-0115) cache
+--
+-- Remembers the disco#info of each verified caps hash, so that it only
+-- needs to be queried once per host instead of once per contact, and
+-- survives restarts.
+
+local cache = require "prosody.util.cache";
+local calculate_hash = require "prosody.util.caps".calculate_hash;
+local st = require "prosody.util.stanza";
+local jid_bare = require "prosody.util.jid".bare;
+local jid_join = require "prosody.util.jid".join;
+
+local xmlns_disco_info = "http://jabber.org/protocol/disco#info";
+
+local cache_size = module:get_option_integer("caps_cache_size", 10000, 1);
+local persist = module:get_option_boolean("caps_cache_persist", true);
+local save_interval = module:get_option_period("caps_cache_save_interval", 60);
+local query_timeout = module:get_option_period("caps_query_timeout", 60);
+
+local lookups = module:metric("counter", "lookups", "", "Entity capabilities cache lookups", { "result" });
+local hits = lookups:with_labels("hit");
+local misses = lookups:with_labels("miss");
+local deduplicated = lookups:with_labels("deduplicated");
+
+local store = module:open_store("caps");
+
+local dirty = false;
+
+-- hash -> { features = { var, ... }, identities = { { category, type, name, lang }, ... } }
+local known = cache.new(cache_size, function ()
+	dirty = true;
+end);
+
+-- hash -> query in flight for it, { key, sent, verifiable, tried }
+local queries = cache.new(cache_size);
+
+-- (user_bare \0 contact) -> hash it is waiting for
+local waiting_for = {};
+
+-- hash -> (user_bare \0 contact) -> { callback, node, user, contact }
+local waiting = cache.new(cache_size, function (_, waiters)
+	for key in pairs(waiters) do
+		waiting_for[key] = nil;
+	end
+end);
+
+local function parse_info(tags)
+	local features, identities = {}, {};
+	for _, tag in ipairs(tags) do
+		if tag.name == "feature" and tag.attr.var then
+			features[#features+1] = tag.attr.var;
+		elseif tag.name == "identity" then
+			identities[#identities+1] = {
+				category = tag.attr.category; type = tag.attr.type;
+				name = tag.attr.name; lang = tag.attr["xml:lang"];
+			};
+		end
+	end
+	return { features = features; identities = identities };
+end
+
+function get(hash)
+	return known:get(hash);
+end
+
+function set(hash, info)
+	known:set(hash, info);
+	dirty = true;
+end
+
+local retry_query;
+
+local function send_query(hash, key, verifiable, tried, send)
+	local waiter = waiting:get(hash)[key];
+	local query = { key = key; sent = os.time(); verifiable = verifiable; tried = tried };
+	tried[key] = true;
+	queries:set(hash, query);
+	-- COMPAT from ~= stanza.attr.to because OneTeam can't deal with missing from attribute
+	send(
+		st.stanza("iq", { from = waiter.user, to = waiter.contact, id = "disco", type = "get" })
+			:tag("query", { xmlns = xmlns_disco_info, node = waiter.node })
+	);
+	if verifiable then
+		module:add_timer(query_timeout, function ()
+			if queries:get(hash) == query then
+				retry_query(hash, query);
+			end
+		end);
+	end
+end
+
+-- Asks another contact advertising the same hash, when the one that was
+-- asked went away, failed to answer or answered with something else
+function retry_query(hash, query)
+	queries:set(hash, nil);
+	local waiters = waiting:get(hash);
+	if not (query.verifiable and waiters) then
+		return;
+	end
+	for key in pairs(waiters) do
+		if not query.tried[key] then
+			send_query(hash, key, true, query.tried, function (stanza) module:send(stanza); end);
+			return;
+		end
+	end
+end
+
+-- Forget the pending lookup of a contact, e.g. when it goes offline
+function cancel(user_bare, contact)
+	local key = user_bare.."\0"..contact;
+	local hash = waiting_for[key];
+	if hash then
+		waiting_for[key] = nil;
+		local waiters = waiting:get(hash);
+		if waiters then
+			waiters[key] = nil;
+		end
+		local query = queries:get(hash);
+		if query and query.key == key then
+			retry_query(hash, query);
+		end
+	end
+end
+
+-- Calls callback(info, cached) once the disco#info for the caps hash advertised by
+-- contact is known, sending a query from user_bare for it if needed.
+-- Only one query is sent per verifiable hash at a time.
+function lookup(hash, query_node, verifiable, user_bare, contact, origin, callback)
+	local info = known:get(hash);
+	if info then
+		hits:add(1);
+		callback(info, true);
+		return;
+	end
+
+	local waiters = waiting:get(hash);
+	if not waiters then
+		waiters = {};
+		waiting:set(hash, waiters);
+	end
+	local key = user_bare.."\0"..contact;
+	local previous = waiting_for[key];
+	if previous and previous ~= hash then
+		cancel(user_bare, contact);
+	end
+	waiters[key] = { callback = callback; node = query_node; user = user_bare; contact = contact };
+	waiting_for[key] = hash;
+
+	local query = queries:get(hash);
+	if verifiable and query and query.key ~= key and os.time() - query.sent < query_timeout then
+		deduplicated:add(1);
+		return;
+	end
+
+	misses:add(1);
+	send_query(hash, key, verifiable, {}, origin.send);
+end
+
+local function get_query_key(event)
+	local stanza, origin = event.stanza, event.origin;
+	local user_bare = jid_bare(stanza.attr.to);
+	if stanza.attr.to == nil then
+		user_bare = jid_join(origin.username, module.host);
+	end
+	return user_bare.."\0"..stanza.attr.from, user_bare;
+end
+
+module:hook("iq-result/bare/disco", function(event)
+	local disco = event.stanza:get_child("query", xmlns_disco_info);
+	if not disco then
+		return;
+	end
+
+	local key, user_bare = get_query_key(event);
+	local ver = calculate_hash(disco.tags);
+	local info = parse_info(disco.tags);
+	set(ver, info);
+
+	local resolved = {};
+	local waiters = waiting:get(ver);
+	if waiters then
+		-- Anyone waiting for this hash can use the answer
+		waiting:set(ver, nil);
+		queries:set(ver, nil);
+		for waiter_key, waiter in pairs(waiters) do
+			waiting_for[waiter_key] = nil;
+			resolved[#resolved+1] = waiter.callback;
+		end
+	end
+	-- Legacy caps, or an answer not matching the hash, is only used by whoever asked
+	local hash = waiting_for[key];
+	if hash then
+		resolved[#resolved+1] = waiting:get(hash)[key].callback;
+		cancel(user_bare, event.stanza.attr.from);
+	end
+
+	for _, callback in ipairs(resolved) do
+		callback(info);
+	end
+end);
+
+module:hook("iq-error/bare/disco", function(event)
+	local _, user_bare = get_query_key(event);
+	cancel(user_bare, event.stanza.attr.from);
+end);
+
+local function save()
+	if not persist or not dirty then
+		return;
+	end
+	local data = {};
+	for hash, info in known:items() do
+		data[hash] = info;
+	end
+	local ok, err = store:set(nil, data);
+	if not ok then
+		module:log("error", "Could not save caps cache: %s", err);
+		return;
+	end
+	dirty = false;
+end
+
+function module.load()
+	if not persist then
+		return;
+	end
+	local data, err = store:get(nil);
+	if err then
+		module:log("error", "Could not load caps cache: %s", err);
+		return;
+	end
+	local count = 0;
+	for hash, info in pairs(data or {}) do
+		known:set(hash, info);
+		count = count + 1;
+	end
+	dirty = false;
+	module:log("debug", "Loaded %d cached caps hashes", count);
+end
+
+if persist then
+	module:add_timer(save_interval, function ()
+		save();
+		return save_interval;
+	end);
+end
+
+function module.save()
+	return { known = known };
+end
+
+function module.restore(data)
+	if data.known then
+		for hash, info in data.known:items() do
+			known:set(hash, info);
+		end
+	end
+end
+
+function module.unload()
+	save();
+end
+
+module:hook_global("server-stopping", save);
@@ -75,6 +75,23 @@ module:hook("carbons-should-copy", function (event)
 	return should;
 end, -1)
 
+local function wants_copy(session, c2s, target_session, top_priority)
+	-- Carbons are sent to resources that have enabled it
+	return session.want_carbons
+	-- but not the resource that sent the message, or the one that it's directed to
+	and session ~= target_session
+	-- and isn't among the top resources that would receive the message per standard routing rules
+	and (c2s or session.priority ~= top_priority);
+end
+
+local function strip_private(stanza)
+	stanza:maptags(function(tag)
+		if not ( tag.attr.xmlns == xmlns_carbons and tag.name == "private" ) then
+			return tag;
+		end
+	end);
+end
+
 local function message_handler(event, c2s)
 	local origin, stanza = event.origin, event.stanza;
 	local orig_type = stanza.attr.type or "normal";
@@ -106,6 +123,23 @@ local function message_handler(event, c2s)
 		module:log("debug", "Skip carbons for offline user");
 		return -- No use in sending carbons to an offline user
 	end
+	user_sessions = user_sessions.sessions;
+
+	-- Most users have no other resource with carbons enabled, so check that
+	-- before looking closer at the stanza
+	local any_copies = false;
+	for _, session in pairs(user_sessions) do
+		if wants_copy(session, c2s, target_session, top_priority) then
+			any_copies = true;
+			break;
+		end
+	end
+	if not any_copies then
+		if not c2s and stanza:get_child("private", xmlns_carbons) then
+			strip_private(stanza);
+		end
+		return;
+	end
 
 	local event_payload = { stanza = stanza; session = origin };
 	local should = module:fire_event("carbons-should-copy", event_payload);
@@ -114,24 +148,15 @@ local function message_handler(event, c2s)
 	if not should then
 		module:log("debug", "Not copying stanza: %s (%s)", stanza:top_tag(), why);
 		if why == "private" and not c2s then
-			stanza:maptags(function(tag)
-				if not ( tag.attr.xmlns == xmlns_carbons and tag.name == "private" ) then
-					return tag;
-				end
-			end);
+			strip_private(stanza);
 		end
 		return;
 	end
 
+	-- The forwarded copy is made once and the same carbon sent to every resource
 	local carbon;
-	user_sessions = user_sessions and user_sessions.sessions;
 	for _, session in pairs(user_sessions) do
-		-- Carbons are sent to resources that have enabled it
-		if session.want_carbons
-		-- but not the resource that sent the message, or the one that it's directed to
-		and session ~= target_session
-		-- and isn't among the top resources that would receive the message per standard routing rules
-		and (c2s or session.priority ~= top_priority) then
+		if wants_copy(session, c2s, target_session, top_priority) then
 			if not carbon then
 				-- Create the carbon copy and wrap it as per the Stanza Forwarding XEP
 				local copy = st.clone(stanza);
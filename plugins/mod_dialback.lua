@@ -160,7 +160,7 @@ module:hook("stanza/jabber:server:dialback:result", function(event)
 		if not hosts[attr.to] then
 			origin:close("host-unknown");
 			return true;
-		elseif hosts[attr.to].s2sout[attr.from] ~= origin then
+		elseif hosts[attr.to].s2sout[attr.from] ~= origin and hosts[attr.to].s2sout[attr.from] ~= origin.primary_stream then
 			-- This isn't right
 			origin:close("invalid-id");
 			return true;
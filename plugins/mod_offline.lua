@@ -12,6 +12,9 @@ local jid_split = require "prosody.util.jid".split;
 
 local offline_messages = module:open_store("offline", "archive");
 
+local chunk_size = module:get_option_integer("offline_delivery_chunk_size", 100, 1);
+local smacks_queue_size = module:get_option_integer("smacks_max_queue_size", 500, 1);
+
 module:add_feature("msgoffline");
 
 module:hook("message/offline/handle", function(event)
@@ -31,21 +34,132 @@ module:hook("message/offline/handle", function(event)
 	return ok;
 end, -1);
 
-module:hook("message/offline/broadcast", function(event)
-	local origin = event.origin;
-	origin.log("debug", "Broadcasting offline messages");
+-- Removes messages that have been delivered from the spool, mostly with a
+-- single range delete. sent lists every message delivered but still in the
+-- spool, oldest first. Everything up to and including the timestamp of the
+-- last one has been delivered, unless the next one has the same timestamp or
+-- a new one may still arrive within that second.
+-- Returns true if the spool now starts after the delivered messages.
+local function consume(origin, sent, next_item)
+	local node = origin.username;
+	local last_when = sent[#sent].when;
+	local ok, err;
+	if next_item and next_item.when <= last_when then
+		return false;
+	elseif not next_item and last_when >= os.time() then
+		-- Messages stored this very second, so delete the rest one by one
+		ok, err = offline_messages:delete(node, { ["end"] = last_when - 1 });
+		for _, item in ipairs(sent) do
+			if ok and item.when >= last_when then
+				ok, err = offline_messages:delete(node, { key = item.key });
+			end
+		end
+	else
+		ok, err = offline_messages:delete(node, { ["end"] = last_when });
+	end
+	if not ok then
+		origin.log("error", "Could not remove delivered offline messages: %s", err);
+		return false;
+	elseif type(ok) == "number" and ok > 0 then
+		origin.log("debug", "%d offline messages consumed", ok);
+	end
+	return true;
+end
+
+-- username -> session the spool is being delivered to, so that another
+-- resource coming online doesn't get it all again from the start
+local delivering = {};
+
+local function done_delivering(origin)
+	if delivering[origin.username] == origin then
+		delivering[origin.username] = nil;
+	end
+	origin.offline_delivery_pending, origin.offline_delivery_sent = nil, nil;
+end
 
+-- Sends the spool in chunks. With Stream Management, the chunks are held back
+-- until the client has acknowledged enough to not overflow its queue.
+local function deliver(origin)
 	local node, host = origin.username, origin.host;
+	delivering[node] = origin;
+	local sent = origin.offline_delivery_sent or {};
+	while not origin.destroyed do
+		local limit = chunk_size;
+		local queue = origin.smacks and origin.outgoing_stanza_queue;
+		if queue then
+			limit = math.min(limit, smacks_queue_size - queue:count_unacked());
+		end
+		if limit < chunk_size and queue:count_unacked() > 0 then
+			origin.log("debug", "Waiting for acknowledgement before sending more offline messages");
+			origin.offline_delivery_pending, origin.offline_delivery_sent = true, sent;
+			return;
+		end
+		origin.offline_delivery_pending = nil;
 
-	local data = offline_messages:find(node);
-	if not data then return true; end
-	for _, stanza, when in data do
-		stanza:tag("delay", {xmlns = "urn:xmpp:delay", from = host, stamp = datetime.datetime(when)}):up(); -- XEP-0203
-		origin.send(stanza);
+		-- One more than needed, to know if there is more to come
+		local after = sent[1] and sent[#sent].key;
+		local data, err = offline_messages:find(node, { limit = limit + 1, after = after });
+		if not data then
+			origin.log("error", "Could not load offline messages: %s", err);
+			break;
+		end
+		local chunk = {};
+		for key, stanza, when in data do
+			chunk[#chunk+1] = { key = key, stanza = stanza, when = when };
+		end
+		if chunk[1] == nil then
+			break;
+		end
+
+		local count = math.min(#chunk, limit);
+		for i = 1, count do
+			local item = chunk[i];
+			item.stanza:tag("delay", {xmlns = "urn:xmpp:delay", from = host, stamp = datetime.datetime(item.when)}):up(); -- XEP-0203
+			origin.send(item.stanza);
+			sent[#sent+1] = { key = item.key, when = item.when };
+		end
+		if consume(origin, sent, chunk[count + 1]) then
+			sent = {};
+		end
+		if not chunk[count + 1] then
+			break;
+		end
 	end
-	local ok = offline_messages:delete(node);
-	if type(ok) == "number" and ok > 0 then
-		origin.log("debug", "%d offline messages consumed");
+	done_delivering(origin);
+end
+
+module:hook("message/offline/broadcast", function(event)
+	local origin = event.origin;
+	local current = delivering[origin.username];
+	if current and current ~= origin and not current.destroyed then
+		origin.log("debug", "Offline messages are already being delivered to %s", current.full_jid);
+		return true;
 	end
+	origin.log("debug", "Broadcasting offline messages");
+	deliver(origin);
 	return true;
 end, -1);
+
+module:hook("smacks-ack-received", function(event)
+	local origin = event.origin;
+	if origin.offline_delivery_pending then
+		deliver(origin);
+	end
+end);
+
+-- Hand an unfinished delivery over to another available resource
+module:hook("resource-unbind", function(event)
+	local session = event.session;
+	if delivering[session.username] ~= session then
+		return;
+	end
+	done_delivering(session);
+	local user = prosody.bare_sessions[session.username.."@"..session.host];
+	for _, other in pairs(user and user.sessions or {}) do
+		if other ~= session and other.presence and other.priority and other.priority >= 0 then
+			other.log("debug", "Taking over delivery of offline messages");
+			deliver(other);
+			return;
+		end
+	end
+end);
@@ -4,13 +4,15 @@ local jid_split = require "prosody.util.jid".split;
 local jid_join = require "prosody.util.jid".join;
 local set_new = require "prosody.util.set".new;
 local st = require "prosody.util.stanza";
-local calculate_hash = require "prosody.util.caps".calculate_hash;
 local rostermanager = require "prosody.core.rostermanager";
 local cache = require "prosody.util.cache";
 local set = require "prosody.util.set";
 local new_id = require "prosody.util.id".medium;
 local storagemanager = require "prosody.core.storagemanager";
 local usermanager = require "prosody.core.usermanager";
+local time_now = require "prosody.util.time".now;
+
+local t_remove = table.remove;
 
 local xmlns_pubsub = "http://jabber.org/protocol/pubsub";
 local xmlns_pubsub_event = "http://jabber.org/protocol/pubsub#event";
@@ -19,6 +21,7 @@ local xmlns_pubsub_owner = "http://jabber.org/protocol/pubsub#owner";
 local is_contact_subscribed = rostermanager.is_contact_subscribed;
 
 local lib_pubsub = module:require "pubsub";
+local mod_caps = module:depends "caps";
 
 local empty_set = set_new();
 
@@ -28,23 +31,46 @@ local pep_service_items = {};
 -- size of caches with full pubsub service objects
 local service_cache_size = module:get_option_integer("pep_service_cache_size", 1000, 1);
 
+-- size of caches with smaller objects
+local info_cache_size = module:get_option_integer("pep_info_cache_size", 10000, 1);
+
+-- username -> node name -> node data, for services evicted from the cache
+local hibernated = cache.new(info_cache_size):table();
+
+local service_loads = module:metric("counter", "service_loads", "", "PEP services instantiated", { "source" });
+
+-- Keep what was loaded from storage, so that bringing the service back is cheap
+local function hibernate(username, service)
+	local stub = {};
+	for node_name, node in pairs(service.nodes) do
+		stub[node_name] = {
+			name = node_name;
+			config = node.config;
+			subscribers = node.subscribers;
+			affiliations = node.affiliations;
+		};
+	end
+	hibernated[username] = stub;
+end
+
 -- username -> util.pubsub service object
-local services = cache.new(service_cache_size, function (username, _)
+local services = cache.new(service_cache_size, function (username, service)
 	local item = pep_service_items[username];
 	pep_service_items[username] = nil;
 	if item then
 		module:remove_item("pep-service", item);
 	end
+	hibernate(username, service);
 end):table();
 
--- size of caches with smaller objects
-local info_cache_size = module:get_option_integer("pep_info_cache_size", 10000, 1);
-
 -- username -> recipient -> set of nodes
 local recipients = cache.new(info_cache_size):table();
 
--- caps hash -> set of nodes
-local hash_map = cache.new(info_cache_size):table();
+-- username -> node -> recipients interested in and allowed to see it
+local node_recipients = cache.new(info_cache_size):table();
+
+-- caps info -> set of nodes
+local notify_sets = setmetatable({}, { __mode = "k" });
 
 local host = module.host;
 
@@ -53,6 +79,14 @@ local known_nodes = module:open_store("pep");
 
 local max_max_items = module:get_option_number("pep_max_items", 256, 0);
 
+-- notifications sent before handing the rest to the next tick
+local broadcast_batch_size = module:get_option_integer("pep_broadcast_batch_size", 100, 1);
+
+local notification_counter = module:metric("counter", "notifications", "", "PEP notifications sent"):with_labels();
+local notification_latency = module:metric("histogram", "notification_latency", "seconds",
+	"Time from a PEP publish until the last notification was sent", {},
+	{ buckets = { 0.001, 0.01, 0.1, 1, 10 } }):with_labels();
+
 local function tonumber_max_items(n)
 	if n == "max" then
 		return max_max_items;
@@ -101,10 +135,15 @@ local function subscription_presence(username, recipient)
 	return is_contact_subscribed(username, host, recipient_bare);
 end
 
-local function nodestore(username)
+-- Nodes of a hibernated service are restored from the stub instead of
+-- storage, which only happens while the service is created
+local function nodestore(username, stub)
 	-- luacheck: ignore 212/self
 	local store = {};
 	function store:get(node)
+		if stub then
+			return stub[node];
+		end
 		local data, err = node_config:get(username, node)
 		if data == true then
 			-- COMPAT Previously stored only a boolean representing 'persist_items'
@@ -121,6 +160,9 @@ local function nodestore(username)
 		return node_config:set(username, node, data);
 	end
 	function store:users()
+		if stub then
+			return pairs(stub);
+		end
 		return pairs(known_nodes:get(username) or {});
 	end
 	return store;
@@ -138,6 +180,35 @@ end
 
 local function get_broadcaster(username)
 	local user_bare = jid_join(username, host);
+
+	-- The same stanza is sent to everyone, in batches so that large rosters
+	-- don't hold up everything else. Broadcasts are sent in order, so nobody
+	-- sees an older item after a newer one.
+	local queue = {};
+	local function send_batch()
+		local count = 0;
+		while queue[1] and count < broadcast_batch_size do
+			local broadcast = queue[1];
+			local message, jids, jid = broadcast.message, broadcast.jids, broadcast.jid;
+			while jid ~= nil and count < broadcast_batch_size do
+				module:log("debug", "Sending notification to %s from %s for node %s", jid, user_bare, broadcast.node);
+				message.attr.to = jid;
+				module:send(message);
+				count = count + 1;
+				jid = next(jids, jid);
+			end
+			broadcast.jid = jid;
+			if jid == nil then
+				notification_latency:sample(time_now() - broadcast.started);
+				t_remove(queue, 1);
+			end
+		end
+		notification_counter:add(count);
+		if queue[1] then
+			module:add_timer(0, send_batch);
+		end
+	end
+
 	local function simple_broadcast(kind, node, jids, item, _, node_obj)
 		local expose_publisher;
 		if node_obj then
@@ -173,15 +244,29 @@ local function get_broadcaster(username)
 			message:add_child(item);
 		end
 
-		for jid in pairs(jids) do
-			module:log("debug", "Sending notification to %s from %s for node %s", jid, user_bare, node);
-			message.attr.to = jid;
-			module:send(message);
+		queue[#queue+1] = { message = message, node = node, jids = jids, jid = next(jids), started = time_now() };
+		if #queue == 1 then
+			send_batch();
 		end
 	end
 	return simple_broadcast;
 end
 
+local function invalidate_recipients(username)
+	node_recipients[username] = nil;
+end
+
+-- Who gets notifications depends on the roster, so the set computed for a
+-- node is only reused while the roster version is the same
+local function get_roster_version(username)
+	local user_session = prosody.hosts[host].sessions[username];
+	local roster = user_session and user_session.roster;
+	local version = roster and roster[false].version;
+	if type(version) == "number" then
+		return version;
+	end
+end
+
 local function get_subscriber_filter(username)
 	return function (jids, node)
 		local broadcast_to = {};
@@ -191,12 +276,28 @@ local function get_subscriber_filter(username)
 
 		local service_recipients = recipients[username];
 		if service_recipients then
-			local service = services[username];
-			for recipient, nodes in pairs(service_recipients) do
-				if nodes:contains(node) and service:may(node, recipient, "subscribe") then
-					broadcast_to[recipient] = true;
+			local roster_version = get_roster_version(username);
+			local service_cache = node_recipients[username];
+			local interested = service_cache and service_cache[node];
+			if not interested or interested.roster_version ~= roster_version then
+				interested = { roster_version = roster_version, jids = {} };
+				local service = services[username];
+				for recipient, nodes in pairs(service_recipients) do
+					if nodes:contains(node) and service:may(node, recipient, "subscribe") then
+						interested.jids[recipient] = true;
+					end
+				end
+				if roster_version then
+					if not service_cache then
+						service_cache = {};
+						node_recipients[username] = service_cache;
+					end
+					service_cache[node] = interested;
 				end
 			end
+			for recipient in pairs(interested.jids) do
+				broadcast_to[recipient] = true;
+			end
 		end
 		return broadcast_to;
 	end
@@ -227,7 +328,15 @@ function get_pep_service(username)
 	if not usermanager.user_exists(username, host) then
 		return nobody_service;
 	end
-	module:log("debug", "Creating pubsub service for user %q", username);
+	local stub = hibernated[username];
+	if stub then
+		hibernated[username] = nil;
+		module:log("debug", "Waking pubsub service for user %q", username);
+		service_loads:with_labels("hibernated"):add(1);
+	else
+		module:log("debug", "Creating pubsub service for user %q", username);
+		service_loads:with_labels("storage"):add(1);
+	end
 	service = pubsub.new({
 		pep_username = username;
 		node_defaults = {
@@ -241,7 +350,7 @@ function get_pep_service(username)
 		autocreate_on_publish = true;
 		autocreate_on_subscribe = false;
 
-		nodestore = nodestore(username);
+		nodestore = nodestore(username, stub);
 		itemstore = simple_itemstore(username);
 		broadcaster = get_broadcaster(username);
 		subscriber_filter = get_subscriber_filter(username);
@@ -280,6 +389,11 @@ function get_pep_service(username)
 
 		check_node_config = check_node_config;
 	});
+	for _, event_name in ipairs({ "node-created", "node-deleted", "node-config-changed", "affiliation-changed" }) do
+		service.events.add_handler(event_name, function ()
+			invalidate_recipients(username);
+		end);
+	end
 	services[username] = service;
 	local item = { service = service, jid = user_bare }
 	pep_service_items[username] = item;
@@ -310,7 +424,7 @@ local function get_caps_hash_from_presence(stanza, current)
 			local attr = child.attr;
 			if attr.hash then -- new caps
 				if attr.hash == 'sha-1' and attr.node and attr.ver then
-					return attr.ver, attr.node.."#"..attr.ver;
+					return attr.ver, attr.node.."#"..attr.ver, true;
 				end
 			else -- legacy caps
 				if attr.node and attr.ver then
@@ -325,6 +439,22 @@ local function get_caps_hash_from_presence(stanza, current)
 	return current; -- no caps, could mean caps optimization, so return current
 end
 
+local function get_notify_set(info)
+	if not info then
+		return nil;
+	end
+	local notify = notify_sets[info];
+	if not notify then
+		notify = set_new();
+		for _, feature in ipairs(info.features) do
+			local nfeature = feature:match("^(.*)%+notify$");
+			if nfeature then notify:add(nfeature); end
+		end
+		notify_sets[info] = notify;
+	end
+	return notify;
+end
+
 local function resend_last_item(jid, node, service)
 	local ok, config = service:get_node_config(node, true);
 	if ok and config.send_last_published_item ~= "on_sub_and_presence" then return end
@@ -351,9 +481,9 @@ local function update_subscriptions(recipient, service_name, nodes)
 		return;
 	end
 
-	local service = get_pep_service(service_name);
-
+	local service;
 	for node in nodes - current do
+		service = service or get_pep_service(service_name);
 		if service:may(node, recipient, "subscribe") then
 			resend_last_item(recipient, node, service);
 		end
@@ -364,6 +494,7 @@ local function update_subscriptions(recipient, service_name, nodes)
 	end
 
 	service_recipients[recipient] = nodes;
+	invalidate_recipients(service_name);
 end
 
 module:hook("presence/bare", function(event)
@@ -382,24 +513,31 @@ module:hook("presence/bare", function(event)
 		if is_self or subscription_presence(username, stanza.attr.from) then
 			local recipient = stanza.attr.from;
 			local current = recipients[username] and recipients[username][recipient];
-			local hash, query_node = get_caps_hash_from_presence(stanza, current);
-			if current == hash or (current and current == hash_map[hash]) then return; end
+			local hash, query_node, verifiable = get_caps_hash_from_presence(stanza, current);
+			if current == hash or (current and current == get_notify_set(mod_caps.get(hash))) then return; end
 			if not hash then
 				update_subscriptions(recipient, username);
 			else
 				recipients[username] = recipients[username] or {};
-				if hash_map[hash] then
-					update_subscriptions(recipient, username, hash_map[hash]);
-				else
-					-- COMPAT from ~= stanza.attr.to because OneTeam can't deal with missing from attribute
-					origin.send(
-						st.stanza("iq", {from=user_bare, to=stanza.attr.from, id="disco", type="get"})
-							:tag("query", {xmlns = "http://jabber.org/protocol/disco#info", node = query_node})
-					);
-				end
+				mod_caps.lookup(hash, query_node, verifiable, user_bare, recipient, origin, function (info, cached)
+					local notify = get_notify_set(info);
+					if is_self and not cached then
+						-- Optimization: Fiddle with other local users
+						for jid, item in pairs(origin.roster) do -- for all interested contacts
+							if jid then
+								local contact_node, contact_host = jid_split(jid);
+								if contact_host == host and (item.subscription == "both" or item.subscription == "from") then
+									update_subscriptions(user_bare, contact_node, notify);
+								end
+							end
+						end
+					end
+					update_subscriptions(recipient, username, notify);
+				end);
 			end
 		end
 	elseif t == "unavailable" then
+		mod_caps.cancel(user_bare, stanza.attr.from);
 		update_subscriptions(stanza.attr.from, username);
 	elseif not is_self and t == "unsubscribe" then
 		local from = jid_bare(stanza.attr.from);
@@ -414,45 +552,6 @@ module:hook("presence/bare", function(event)
 	end
 end, 10);
 
-module:hook("iq-result/bare/disco", function(event)
-	local origin, stanza = event.origin, event.stanza;
-	local disco = stanza:get_child("query", "http://jabber.org/protocol/disco#info");
-	if not disco then
-		return;
-	end
-
-	-- Process disco response
-	local is_self = stanza.attr.to == nil;
-	local user_bare = jid_bare(stanza.attr.to);
-	local username = jid_split(stanza.attr.to);
-	if is_self then
-		username = origin.username;
-		user_bare = jid_join(username, host);
-	end
-	local contact = stanza.attr.from;
-	local ver = calculate_hash(disco.tags); -- calculate hash
-	local notify = set_new();
-	for _, feature in pairs(disco.tags) do
-		if feature.name == "feature" and feature.attr.var then
-			local nfeature = feature.attr.var:match("^(.*)%+notify$");
-			if nfeature then notify:add(nfeature); end
-		end
-	end
-	hash_map[ver] = notify; -- update hash map
-	if is_self then
-		-- Optimization: Fiddle with other local users
-		for jid, item in pairs(origin.roster) do -- for all interested contacts
-			if jid then
-				local contact_node, contact_host = jid_split(jid);
-				if contact_host == host and (item.subscription == "both" or item.subscription == "from") then
-					update_subscriptions(user_bare, contact_node, notify);
-				end
-			end
-		end
-	end
-	update_subscriptions(contact, username, notify);
-end);
-
 module:hook("account-disco-info-node", function(event)
 	local stanza, origin = event.stanza, event.origin;
 	local service_name = origin.username;
@@ -529,6 +628,8 @@ module:hook_global("user-deleted", function(event)
 	if item then module:remove_item("pep-service", item); end
 
 	recipients[username] = nil;
+	hibernated[username] = nil;
+	invalidate_recipients(username);
 end);
 
 module:require("mod_pubsub/commands").add_commands(function (service_jid)
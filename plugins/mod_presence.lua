@@ -30,6 +30,12 @@ local sessionmanager = require "prosody.core.sessionmanager";
 local recalc_resource_map = require "prosody.util.presence".recalc_resource_map;
 
 local ignore_presence_priority = module:get_option_boolean("ignore_presence_priority", false);
+-- Rapid presence updates within this period are merged, contacts only get the latest
+local broadcast_delay = module:get_option_period("presence_broadcast_delay", 0);
+
+local broadcast_count = module:metric("counter", "broadcasts", "", "Presence broadcasts to contacts"):with_labels();
+local broadcast_recipients = module:metric("counter", "broadcast_recipients", "", "Contacts presence was broadcast to"):with_labels();
+local coalesced_count = module:metric("counter", "coalesced", "", "Presence updates superseded before being broadcast"):with_labels();
 
 local pre_approval_stream_feature = st.stanza("sub", {xmlns="urn:xmpp:features:pre-approval"});
 module:hook("stream-features", function(event)
@@ -39,6 +45,28 @@ module:hook("stream-features", function(event)
 	end
 end);
 
+local function broadcast_to_contacts(origin, stanza, roster)
+	local count = 0;
+	for jid, item in pairs(roster) do -- broadcast to all interested contacts
+		if item.subscription == "both" or item.subscription == "from" then
+			stanza.attr.to = jid;
+			core_post_stanza(origin, stanza, true);
+			count = count + 1;
+		end
+	end
+	stanza.attr.to = nil;
+	broadcast_count:add(1);
+	broadcast_recipients:add(count);
+end
+
+local function flush_pending_broadcast(_, origin)
+	local stanza = origin.pending_broadcast;
+	origin.pending_broadcast, origin.pending_broadcast_timer = nil, nil;
+	if stanza and origin.type and origin.presence then
+		broadcast_to_contacts(origin, stanza, origin.roster);
+	end
+end
+
 function handle_normal_presence(origin, stanza)
 	if ignore_presence_priority then
 		local priority = stanza:get_child("priority");
@@ -67,11 +95,22 @@ function handle_normal_presence(origin, stanza)
 			core_post_stanza(origin, stanza, true);
 		end
 	end
-	for jid, item in pairs(roster) do -- broadcast to all interested contacts
-		if item.subscription == "both" or item.subscription == "from" then
-			stanza.attr.to = jid;
-			core_post_stanza(origin, stanza, true);
+	if broadcast_delay > 0 and stanza.attr.type == nil and origin.presence then
+		-- An update to available presence, hold it back in case another follows
+		if origin.pending_broadcast then
+			coalesced_count:add(1);
+		end
+		origin.pending_broadcast = st.clone(stanza);
+		if not origin.pending_broadcast_timer then
+			origin.pending_broadcast_timer = module:add_timer(broadcast_delay, flush_pending_broadcast, origin);
+		end
+	else
+		if origin.pending_broadcast then
+			-- Superseded by this one
+			coalesced_count:add(1);
+			origin.pending_broadcast = nil;
 		end
+		broadcast_to_contacts(origin, stanza, roster);
 	end
 
 	-- It's possible that after the network activity above, the origin
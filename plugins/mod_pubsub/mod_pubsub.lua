@@ -27,7 +27,8 @@ function handle_pubsub_iq(event)
 end
 
 -- An itemstore supports the following methods:
---   items(): iterator over (id, item)
+--   items(resultspec): iterator over (id, item), newest first. Stores with
+--     'paged' set handle the max, after and before of resultspec themselves
 --   get(id): return item with id
 --   set(id, item): set id to item
 --   clear(): clear all items
@@ -4,6 +4,7 @@ local jid_prep = require "prosody.util.jid".prep;
 local set = require "prosody.util.set";
 local st = require "prosody.util.stanza";
 local it = require "prosody.util.iterators";
+local rsm = require "prosody.util.rsm";
 local uuid_generate = require "prosody.util.uuid".generate;
 local dataform = require"prosody.util.dataforms".new;
 local errors = require "prosody.util.error";
@@ -359,9 +360,11 @@ function handlers.get_items(origin, stanza, items, service)
 		return true;
 	end
 
-	local resultspec; -- TODO rsm.get()
+	local paging = not requested_items and rsm.get(stanza.tags[1]);
+	local resultspec = paging or nil;
 	if items.attr.max_items then
-		resultspec = { max = tonumber(items.attr.max_items) };
+		resultspec = resultspec or {};
+		resultspec.max = math.min(tonumber(items.attr.max_items) or math.huge, resultspec.max or math.huge);
 	end
 	local ok, results = service:get_items(node, stanza.attr.from, requested_items, resultspec);
 	if not ok then
@@ -376,8 +379,10 @@ function handlers.get_items(origin, stanza, items, service)
 
 	local data = st.stanza("items", { node = node });
 	local iter, v, i = ipairs(results);
-	if not requested_items then
+	if not requested_items and not paging then
 		-- XXX Hack to preserve order of explicitly requested items.
+		-- When paging, items are kept newest first, as that is what the
+		-- <first> and <last> of the page refer to.
 		iter, v, i = it.reverse(iter, v, i);
 	end
 
@@ -392,6 +397,9 @@ function handlers.get_items(origin, stanza, items, service)
 	local reply = st.reply(stanza)
 		:tag("pubsub", { xmlns = xmlns_pubsub })
 			:add_child(data);
+	if paging and results[1] then
+		reply:add_child(rsm.generate({ first = results[1], last = results[#results] }));
+	end
 	origin.send(reply);
 	return true;
 end
@@ -868,17 +876,49 @@ end
 
 local function archive_itemstore(archive, max_items, user, node)
 	module:log("debug", "Creation of archive itemstore for node %s with limit %d", node, max_items);
-	local get_set = {};
-	function get_set:items() -- luacheck: ignore 212/self
-		local data, err = archive:find(user, {
+	local get_set = { paged = true };
+	function get_set:items(resultspec) -- luacheck: ignore 212/self
+		-- Newest first, starting after or ending before an item when paging
+		local query = {
 			limit = tonumber(max_items);
 			reverse = true;
-		});
+		};
+		local before = resultspec and resultspec.before;
+		if resultspec then
+			if resultspec.max and resultspec.max < (query.limit or math.huge) then
+				query.limit = resultspec.max;
+			end
+			if resultspec.after then
+				query.before = resultspec.after;
+			elseif before then
+				-- Get the oldest items of the page first, then turn it around
+				query.reverse = false;
+				if before ~= true then
+					query.after = before;
+				end
+			end
+		end
+		local data, err = archive:find(user, query);
 		if not data then
 			module:log("error", "Unable to get items: %s", err);
-			return true;
+			return function() end;
 		end
 		module:log("debug", "Listed items %s", data);
+		if before then
+			local page = {};
+			for id, payload, _, publisher in data do
+				table.insert(page, 1, { id, payload, publisher });
+			end
+			local i = 0;
+			return function()
+				i = i + 1;
+				local entry = page[i];
+				if entry == nil then
+					return;
+				end
+				return entry[1], create_encapsulating_item(entry[1], entry[2], entry[3]);
+			end;
+		end
 		return function()
 			-- luacheck: ignore 211/when
 			local id, payload, when, publisher = data();
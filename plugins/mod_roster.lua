@@ -8,18 +8,28 @@
 
 
 local st = require "prosody.util.stanza"
+local async = require "prosody.util.async";
 
 local jid_split = require "prosody.util.jid".split;
 local jid_resource = require "prosody.util.jid".resource;
 local jid_prep = require "prosody.util.jid".prep;
 local tonumber = tonumber;
-local pairs = pairs;
+local pairs, ipairs = pairs, ipairs;
 
 local rostermanager = require "prosody.core.rostermanager";
 local rm_load_roster = rostermanager.load_roster;
 local rm_remove_from_roster = rostermanager.remove_from_roster;
 local rm_add_to_roster = rostermanager.add_to_roster;
 local rm_roster_push = rostermanager.roster_push;
+local rm_roster_push_stanza = rostermanager.roster_push_stanza;
+local rm_get_changes = rostermanager.get_changes;
+
+-- Also read by rostermanager
+local build_subscriber_index = module:get_option_boolean("roster_subscriber_index", true);
+
+local full_rosters_sent = module:metric("counter", "full_rosters", "", "Roster requests answered with the whole roster"):with_labels();
+local roster_diffs_sent = module:metric("counter", "roster_diffs", "", "Roster requests answered with pushes of changed items"):with_labels();
+local roster_diff_items = module:metric("counter", "roster_diff_items", "", "Items pushed to bring stale rosters up to date"):with_labels();
 
 module:add_feature("jabber:iq:roster");
 
@@ -39,8 +49,15 @@ module:hook("iq/self/jabber:iq:roster:query", function(event)
 
 		local client_ver = tonumber(stanza.tags[1].attr.ver);
 		local server_ver = tonumber(session.roster[false].version or 1);
+		local changed = client_ver and server_ver and client_ver ~= server_ver and rm_get_changes(session.roster, client_ver);
 
-		if not (client_ver and server_ver) or client_ver ~= server_ver then
+		if changed then
+			-- Stale roster, but recent enough that the changes since are known,
+			-- so reply empty and push just those
+			roster_diffs_sent:add(1);
+			roster_diff_items:add(#changed);
+		elseif not (client_ver and server_ver) or client_ver ~= server_ver then
+			full_rosters_sent:add(1);
 			roster:query("jabber:iq:roster");
 			-- Client does not support versioning, or has stale roster
 			for jid, item in pairs(session.roster) do
@@ -60,6 +77,12 @@ module:hook("iq/self/jabber:iq:roster:query", function(event)
 			roster.tags[1].attr.ver = tostring(server_ver);
 		end
 		session.send(roster);
+		if changed then
+			local changes = session.roster[false].changes;
+			for _, jid in ipairs(changed) do
+				session.send(rm_roster_push_stanza(session.roster, jid, changes[jid]));
+			end
+		end
 		session.interested = true; -- resource is interested in roster updates
 	else -- stanza.attr.type == "set"
 		local query = stanza.tags[1];
@@ -139,6 +162,7 @@ module:hook_global("user-deleted", function(event)
 			module:fire_event("roster-item-removed", {
 				username = username, jid = jid, item = item, roster = roster, origin = origin,
 			});
+			rostermanager.update_subscriber_index(username, host, jid, nil);
 		else
 			for pending_jid in pairs(item.pending) do
 				module:fire_event("roster-item-removed", {
@@ -149,6 +173,19 @@ module:hook_global("user-deleted", function(event)
 	end
 end, 300);
 
+function module.ready()
+	-- Rosters modified on load can't be indexed, see rostermanager
+	if not build_subscriber_index or module.host == "*" or prosody.hosts[module.host].events.get_handlers("roster-load") then
+		return;
+	end
+	async.runner(function ()
+		local ok, err = rostermanager.build_subscriber_index(module.host);
+		if not ok then
+			module:log("warn", "Could not build roster subscriber index: %s", err);
+		end
+	end):run(true);
+end
+
 -- API/commands
 
 -- Make a *one-way* subscription. User will see when contact is online,
@@ -13,6 +13,8 @@ local hosts = prosody.hosts;
 local core_process_stanza = prosody.core_process_stanza;
 
 local tostring, type = tostring, type;
+local s_byte = string.byte;
+local os_time = os.time;
 local traceback = debug.traceback;
 
 local add_task = require "prosody.util.timer".add_task;
@@ -32,7 +34,8 @@ local service = require "prosody.net.resolvers.service";
 local resolver_chain = require "prosody.net.resolvers.chain";
 local errors = require "prosody.util.error";
 local set = require "prosody.util.set";
-local queue = require "prosody.util.queue";
+local xml_parse = require "prosody.util.xml".parse;
+local t_concat = table.concat;
 
 local connect_timeout = module:get_option_period("s2s_timeout", 90);
 local stream_close_timeout = module:get_option_period("s2s_close_timeout", 5);
@@ -43,6 +46,9 @@ local secure_domains, insecure_domains =
 local require_encryption = module:get_option_boolean("s2s_require_encryption", true);
 local stanza_size_limit = module:get_option_integer("s2s_stanza_size_limit", 1024*512, 10000);
 local sendq_size = module:get_option_integer("s2s_send_queue_size", 1024*32, 1);
+local sendq_memory = module:get_option_integer("s2s_send_queue_memory", 1024*1024, 1024);
+local sendq_disk = module:get_option_integer("s2s_send_queue_disk", 0, 0);
+local outgoing_streams = module:get_option_integer("s2s_outgoing_streams", 1, 1, 16);
 
 local advertised_idle_timeout = 14*60; -- default in all net.server implementations
 local network_settings = module:get_option("network_settings");
@@ -85,6 +91,16 @@ local m_tls_params = module:metric(
 	"Encrypted connections",
 	{"protocol"; "cipher"}
 );
+local measure_sendq_stanzas = module:metric(
+	"gauge", "sendq_stanzas", "",
+	"Stanzas queued while connecting to a remote domain",
+	{"host", "remote"}
+);
+local measure_sendq_bytes = module:metric(
+	"gauge", "sendq", "bytes",
+	"Size of stanzas queued while connecting to a remote domain",
+	{"host", "remote", "location"}
+);
 
 local sessions = module:shared("sessions");
 
@@ -128,15 +144,128 @@ module:hook("stats-update", function ()
 		metric_family:with_labels(host, type_, "ipv4"):add(is_ipv4)
 		metric_family:with_labels(host, type_, "ipv6"):add(is_ipv6)
 	end
+
+	measure_sendq_stanzas:clear()
+	measure_sendq_bytes:clear()
+	for _, host in pairs(hosts) do
+		if host.s2sout then
+			for remote, session in pairs(host.s2sout) do
+				local sendq = session.sendq;
+				if sendq then
+					measure_sendq_stanzas:with_labels(host.host, remote):set(sendq:count())
+					measure_sendq_bytes:with_labels(host.host, remote, "memory"):set(sendq.bytes)
+					measure_sendq_bytes:with_labels(host.host, remote, "disk"):set(sendq.spilled)
+				end
+			end
+		end
+	end
 end);
 
 --- Handle stanzas to remote domains
 
+-- Stanzas waiting for an outgoing connection are kept serialized, bounded by
+-- count and by size. Past s2s_send_queue_memory bytes they go to an anonymous
+-- temporary file, up to s2s_send_queue_disk bytes, so order is preserved.
+local sendq_mt = {};
+sendq_mt.__index = sendq_mt;
+
+local function new_sendq()
+	return setmetatable({ items = {}; head = 1; tail = 0; bytes = 0; spilled = 0; spilled_count = 0 }, sendq_mt);
+end
+
+function sendq_mt:count()
+	return self.tail - self.head + 1 + self.spilled_count;
+end
+
+function sendq_mt:push(data)
+	local size = #data;
+	if self:count() >= sendq_size then
+		return nil, "queue full";
+	end
+	if not self.spill and self.bytes + size <= sendq_memory then
+		self.tail = self.tail + 1;
+		self.items[self.tail] = data;
+		self.bytes = self.bytes + size;
+		return true;
+	end
+	if self.spilled + size > sendq_disk then
+		return nil, "queue full";
+	end
+	if not self.spill then
+		local file, err = io.tmpfile();
+		if not file then
+			return nil, err;
+		end
+		self.spill = file;
+		self.read_offset = 0;
+	end
+	-- Reads may have moved the position, and stdio needs a seek between
+	-- reading and writing anyway
+	self.spill:seek("end");
+	local ok, err = self.spill:write(size, "\n", data);
+	if not ok then
+		return nil, err;
+	end
+	self.spilled = self.spilled + size;
+	self.spilled_count = self.spilled_count + 1;
+	return true;
+end
+
+function sendq_mt:pop()
+	local head = self.head;
+	if head <= self.tail then
+		local data = self.items[head];
+		self.items[head] = nil;
+		self.head = head + 1;
+		self.bytes = self.bytes - #data;
+		return data;
+	end
+	local spill = self.spill;
+	if not spill then
+		return nil;
+	end
+	spill:seek("set", self.read_offset);
+	local size = spill:read("*n");
+	local data = size and spill:read(1) and spill:read(size);
+	if not data then
+		self:close();
+		return nil;
+	end
+	self.read_offset = spill:seek();
+	self.spilled = self.spilled - size;
+	self.spilled_count = self.spilled_count - 1;
+	return data;
+end
+
+function sendq_mt:consume()
+	return self.pop, self;
+end
+
+function sendq_mt:close()
+	if self.spill then
+		self.spill:close();
+		self.spill = nil;
+	end
+	self.items, self.head, self.tail, self.bytes = {}, 1, 0, 0;
+	self.spilled, self.spilled_count = 0, 0;
+end
+
+local function queue_stanza(session, stanza)
+	if not session.sendq then
+		session.sendq = new_sendq();
+	end
+	local ok, err = session.sendq:push(tostring(stanza));
+	if not ok then
+		(session.log or log)("warn", "stanza [%s] not queued: %s", stanza.name, err);
+	end
+	return ok;
+end
+
 local bouncy_stanzas = { message = true, presence = true, iq = true };
 local function bounce_sendq(session, reason)
 	local sendq = session.sendq;
 	if not sendq then return; end
-	session.log("info", "Sending error replies for %d queued stanzas because of failed outgoing connection to %s", sendq.count(), session.to_host);
+	session.log("info", "Sending error replies for %d queued stanzas because of failed outgoing connection to %s", sendq:count(), session.to_host);
 	local dummy = {
 		type = "s2sin";
 		send = function ()
@@ -160,8 +289,11 @@ local function bounce_sendq(session, reason)
 	elseif type(reason) == "string" then
 		reason_text = reason;
 	end
-	for stanza in sendq:consume() do
-		if not stanza.attr.xmlns and bouncy_stanzas[stanza.name] and stanza.attr.type ~= "error" and stanza.attr.type ~= "result" then
+	for data in sendq:consume() do
+		local stanza = xml_parse(data);
+		if not stanza then
+			(session.log or log)("error", "Unable to parse queued stanza, discarding it");
+		elseif not stanza.attr.xmlns and bouncy_stanzas[stanza.name] and stanza.attr.type ~= "error" and stanza.attr.type ~= "result" then
 			local reply = st.error_reply(
 				stanza,
 				error_type,
@@ -173,9 +305,12 @@ local function bounce_sendq(session, reason)
 			(session.log or log)("debug", "Not eligible for bouncing, discarding %s", stanza:top_tag());
 		end
 	end
+	sendq:close();
 	session.sendq = nil;
 end
 
+local pick_stream; -- see parallel outgoing streams below
+
 -- Handles stanzas to existing s2s sessions
 function route_to_existing_session(event)
 	local from_host, to_host, stanza = event.from_host, event.to_host, event.stanza;
@@ -189,18 +324,14 @@ function route_to_existing_session(event)
 	end
 	local host = hosts[from_host].s2sout[to_host];
 	if not host then return end
+	host = pick_stream(host, stanza);
 
 	-- We have a connection to this host already
 	if host.type == "s2sout_unauthed" and (stanza.name ~= "db:verify" or not host.dialback_key) then
 		(host.log or log)("debug", "trying to send over unauthed s2sout to "..to_host);
 
 		-- Queue stanza until we are able to send it
-		if not host.sendq then
-			-- luacheck: ignore 122
-			host.sendq = queue.new(sendq_size);
-		end
-		if not host.sendq:push(st.clone(stanza)) then
-			host.log("warn", "stanza [%s] not queued ", stanza.name);
+		if not queue_stanza(host, stanza) then
 			event.origin.send(st.error_reply(stanza, "wait", "resource-constraint", "Outgoing stanza queue full"));
 			return true;
 		end
@@ -218,18 +349,8 @@ function route_to_existing_session(event)
 	end
 end
 
--- Create a new outgoing session for a stanza
-function route_to_new_session(event)
-	local from_host, to_host, stanza = event.from_host, event.to_host, event.stanza;
-	log("debug", "opening a new outgoing connection for this stanza");
-	local host_session = s2s_new_outgoing(from_host, to_host);
-	host_session.version = 1;
-
-	-- Store in buffer
-	host_session.bounce_sendq = bounce_sendq;
-	host_session.sendq = queue.new(sendq_size);
-	host_session.sendq:push(st.clone(stanza));
-	log("debug", "stanza [%s] queued until connection complete", stanza.name);
+local function connect_outgoing(host_session)
+	local from_host, to_host = host_session.from_host, host_session.to_host;
 	-- FIXME Cleaner solution to passing extra data from resolvers to net.server
 	-- This mt-clone allows resolvers to add extra data, currently used for DANE TLSA records
 	module:context(from_host):fire_event("s2sout-created", { session = host_session });
@@ -249,9 +370,151 @@ function route_to_new_session(event)
 	resolver = pre_event.resolver;
 	connect(resolver, listener, nil, { session = host_session });
 	m_initiated_connections:with_labels(from_host):add(1)
+end
+
+-- Create a new outgoing session for a stanza
+function route_to_new_session(event)
+	local from_host, to_host, stanza = event.from_host, event.to_host, event.stanza;
+	log("debug", "opening a new outgoing connection for this stanza");
+	local host_session = s2s_new_outgoing(from_host, to_host);
+	host_session.version = 1;
+
+	-- Store in buffer
+	host_session.bounce_sendq = bounce_sendq;
+	if queue_stanza(host_session, stanza) then
+		log("debug", "stanza [%s] queued until connection complete", stanza.name);
+	else
+		event.origin.send(st.error_reply(stanza, "wait", "resource-constraint", "Outgoing stanza queue full"));
+	end
+	connect_outgoing(host_session);
 	return true;
 end
 
+--- Parallel outgoing streams
+-- With s2s_outgoing_streams > 1, more streams to a remote domain are opened
+-- once the first one is established. Stanzas are spread across them by
+-- sender and recipient, so each pair always uses the same stream.
+
+-- Stanzas queued for an extra stream that could not be established are
+-- sent over the main stream instead, keeping them in order. A main stream
+-- that is going away has already let go of its extra streams.
+local function hand_back_sendq(stream, reason)
+	local primary, sendq = stream.primary_stream, stream.sendq;
+	if not (sendq and primary and primary.extra_streams and primary.type == "s2sout" and primary.flush_sendq) then
+		return bounce_sendq(stream, reason);
+	end
+	stream.log("debug", "sending %d queued stanzas over the main stream to %s instead", sendq:count(), stream.to_host);
+	primary.flush_sendq(sendq);
+	sendq:close();
+	stream.sendq = nil;
+end
+
+local function open_extra_stream(primary, slot)
+	local stream = s2s_new_outgoing(primary.from_host, primary.to_host, true);
+	stream.version = 1;
+	stream.bounce_sendq = hand_back_sendq;
+	stream.primary_stream = primary;
+	stream.stream_slot = slot;
+	primary.extra_streams[slot] = stream;
+	primary.log("debug", "opening extra stream %d to %s", slot, primary.to_host);
+	connect_outgoing(stream);
+end
+
+local function pair_hash(from, to)
+	local h = 5381;
+	for i = 1, #from do
+		h = (h * 33 + s_byte(from, i)) % 4294967296;
+	end
+	for i = 1, #to do
+		h = (h * 33 + s_byte(to, i)) % 4294967296;
+	end
+	return h;
+end
+
+function pick_stream(session, stanza)
+	local streams = session.extra_streams;
+	if not streams then
+		return session;
+	end
+	local attr = stanza.attr;
+	local slot = pair_hash(attr.from or "", attr.to or "") % outgoing_streams;
+	if slot == 0 then
+		return session;
+	end
+	local stream = streams[slot];
+	if not stream and os_time() >= (streams.retry[slot] or 0) then
+		open_extra_stream(session, slot);
+		stream = streams[slot];
+	end
+	-- Stanzas are queued on the extra stream until it is ready, rather than
+	-- some going over the main stream meanwhile and arriving out of order
+	return stream or session;
+end
+
+module:hook("s2sout-established", function (event)
+	local session = event.session;
+	if outgoing_streams < 2 or session.primary_stream or session.extra_streams or session.incoming then
+		return;
+	end
+	if hosts[session.from_host].s2sout[session.to_host] ~= session then
+		return;
+	end
+	session.extra_streams = { retry = {} };
+	for slot = 1, outgoing_streams - 1 do
+		open_extra_stream(session, slot);
+	end
+end);
+
+module:hook("s2s-destroyed", function (event)
+	local session = event.session;
+	local primary = session.primary_stream;
+	if primary then
+		local streams, slot = primary.extra_streams, session.stream_slot;
+		if streams and streams[slot] == session then
+			-- Reopened on demand, but not straight away
+			streams[slot] = nil;
+			streams.retry[slot] = os_time() + connect_timeout;
+		end
+		return;
+	end
+
+	local streams = session.extra_streams;
+	if not streams then
+		return;
+	end
+	-- An established extra stream takes over as the route to the remote domain
+	local s2sout = hosts[session.from_host] and hosts[session.from_host].s2sout;
+	local successor;
+	for slot = 1, outgoing_streams - 1 do
+		local stream = streams[slot];
+		if stream and stream.type == "s2sout" and s2sout and not s2sout[session.to_host] then
+			successor = stream;
+			streams[slot] = nil;
+			break;
+		end
+	end
+	-- Let go of the extra streams first, so that what they have queued is
+	-- not handed to this stream while it is being closed
+	session.extra_streams = nil;
+	if not successor then
+		for slot = 1, outgoing_streams - 1 do
+			if streams[slot] then
+				streams[slot]:close();
+			end
+		end
+		return;
+	end
+	successor.log("debug", "now the main stream to %s", session.to_host);
+	successor.primary_stream, successor.stream_slot = nil, nil;
+	successor.extra_streams = streams;
+	for slot = 1, outgoing_streams - 1 do
+		if streams[slot] then
+			streams[slot].primary_stream = successor;
+		end
+	end
+	s2sout[session.to_host] = successor;
+end);
+
 local function keepalive(event)
 	local session = event.session;
 	if not session.notopen then
@@ -367,12 +630,9 @@ function mark_connected(session)
 
 	if session.direction == "outgoing" then
 		if sendq then
-			session.log("debug", "sending %d queued stanzas across new outgoing connection to %s", sendq.count(), session.to_host);
-			local send = session.sends2s;
-			for stanza in sendq:consume() do
-				-- TODO check send success
-				send(stanza);
-			end
+			session.log("debug", "sending %d queued stanzas across new outgoing connection to %s", sendq:count(), session.to_host);
+			session.flush_sendq(sendq);
+			sendq:close();
 			session.sendq = nil;
 		end
 	end
@@ -839,6 +1099,46 @@ local function initialize_session(session)
 		end
 	end
 
+	-- Sends queued stanzas, concatenated into as few writes as possible
+	function session.flush_sendq(sendq)
+		local stanza_filters = session.filters["stanzas/out"];
+		if stanza_filters and stanza_filters[1] then
+			-- Stanza filters need stanza objects, so no batching
+			for data in sendq:consume() do
+				local stanza = xml_parse(data);
+				if stanza then
+					session.sends2s(stanza);
+				else
+					log("error", "Unable to parse queued stanza, discarding it");
+				end
+			end
+			return;
+		end
+		local size_limit = session.outgoing_stanza_size_limit;
+		local batch, batch_size = {}, 0;
+		local function write_batch()
+			local data = filter("bytes/out", t_concat(batch));
+			batch, batch_size = {}, 0;
+			if data then
+				w(conn, data);
+			end
+		end
+		for data in sendq:consume() do
+			if size_limit and #data > size_limit then
+				log("warn", "Attempt to send a stanza exceeding session limit of %dB (%dB)!", size_limit, #data);
+			else
+				batch[#batch+1] = data;
+				batch_size = batch_size + #data;
+				if batch_size >= sendq_memory then
+					write_batch();
+				end
+			end
+		end
+		if batch[1] then
+			write_batch();
+		end
+	end
+
 	function session.data(data)
 		data = filter("bytes/in", data);
 		if data then
@@ -43,6 +43,11 @@ local resumption_age = module:metric(
 ):with_labels();
 local sessions_expired = module:measure("sessions_expired", "counter");
 local sessions_started = module:measure("sessions_started", "counter");
+local spilled_stanzas = module:measure("hibernation_spilled_stanzas", "counter");
+local sessions_persisted = module:measure("sessions_persisted", "counter");
+-- Together with tx_queued_stanzas these give acks per stanza
+local ack_requests_sent = module:measure("ack_requests_sent", "counter");
+local ack_timer_operations = module:measure("ack_timer_operations", "counter");
 
 
 local datetime = require "prosody.util.datetime";
@@ -54,6 +59,7 @@ local timer = require "prosody.util.timer";
 local new_id = require "prosody.util.id".short;
 local watchdog = require "prosody.util.watchdog";
 local it = require"prosody.util.iterators";
+local xml_parse = require "prosody.util.xml".parse;
 
 local sessionmanager = require "prosody.core.sessionmanager";
 
@@ -74,6 +80,8 @@ local max_unacked_stanzas = module:get_option_integer("smacks_max_unacked_stanza
 local max_inactive_unacked_stanzas = module:get_option_integer("smacks_max_inactive_unacked_stanzas", 256, 0);
 local delayed_ack_timeout = module:get_option_period("smacks_max_ack_delay", 30);
 local max_old_sessions = module:get_option_integer("smacks_max_old_sessions", 10, 0);
+local persistent_hibernation = module:get_option_boolean("smacks_persistent_hibernation", false);
+local spill_delay = module:get_option_period("smacks_hibernation_spill_delay", "1 minute");
 
 local c2s_sessions = module:shared("/*/c2s/sessions");
 local local_sessions = prosody.hosts[module.host].sessions;
@@ -104,6 +112,111 @@ local function clear_old_session(session, id)
 	return old_session_registry:set(session.username, id or session.resumption_token, nil)
 end
 
+-- With smacks_persistent_hibernation, the queues of hibernating sessions are
+-- moved to storage after smacks_hibernation_spill_delay, and sessions are
+-- saved at shutdown so they can be resumed after a restart
+local all_hibernated_sessions = module:open_store("smacks_hibernation");
+local hibernation_store = module:open_store("smacks_hibernation", "map");
+
+local function freeze_session(session, stanzas)
+	local queue = session.outgoing_stanza_queue;
+	local frozen = {};
+	for i, stanza in ipairs(stanzas) do
+		frozen[i] = tostring(stanza);
+	end
+	return {
+		resource = session.resource;
+		h = session.handled_stanza_count;
+		tail = queue:count_acked();
+		head = queue:count_acked() + queue:count_unacked();
+		t = session.hibernating or os_time();
+		interested = session.interested;
+		presence = session.presence and tostring(session.presence) or nil;
+		stanzas = frozen;
+	};
+end
+
+local function thaw_stanzas(session, frozen)
+	local stanzas = {};
+	for _, s in ipairs(frozen) do
+		local stanza, err = xml_parse(s);
+		if stanza then
+			table.insert(stanzas, stanza);
+		else
+			session.log("warn", "Dropping stored stanza that could not be parsed: %s", err);
+		end
+	end
+	return stanzas;
+end
+
+local function spill_queue(session)
+	local queue = session.outgoing_stanza_queue;
+	if session.smacks_spilled or not queue or queue:count_unacked() == 0 then
+		return true;
+	end
+	local token = session.resumption_token;
+	local items = queue:spill();
+	-- Kept here until stored, in case the session is resumed meanwhile
+	local spilled = { token = token; items = items };
+	session.smacks_spilled = spilled;
+	local ok, err = hibernation_store:set(session.username, token, freeze_session(session, items));
+	if session.smacks_spilled ~= spilled then
+		-- Already taken back from memory
+		hibernation_store:set(session.username, token, nil);
+		return true;
+	elseif not ok then
+		session.log("error", "Unable to store queue of hibernating session: %s", err);
+		session.smacks_spilled = nil;
+		queue:restore(items);
+		return nil, err;
+	end
+	spilled.items = nil;
+	spilled_stanzas(#items);
+	session.log("debug", "Moved %d queued stanzas to storage", #items);
+	return true;
+end
+
+local function unspill_queue(session)
+	local spilled = session.smacks_spilled;
+	if not spilled then
+		return true;
+	end
+	local items = spilled.items;
+	if not items then
+		local record, err = hibernation_store:get(session.username, spilled.token);
+		if err then
+			session.log("error", "Unable to load queue of hibernating session: %s", err);
+			return nil, err;
+		end
+		items = record and thaw_stanzas(session, record.stanzas) or {};
+		hibernation_store:set(session.username, spilled.token, nil);
+	end
+	session.smacks_spilled = nil;
+	session.outgoing_stanza_queue:restore(items);
+	session.log("debug", "Restored %d queued stanzas from storage", #items);
+	return true;
+end
+
+local function persist_session(session)
+	local ok, err = unspill_queue(session);
+	if not ok then
+		return nil, err;
+	end
+	local queue = session.outgoing_stanza_queue;
+	local items = queue:spill();
+	local record = freeze_session(session, items);
+	record.persisted = true;
+	ok, err = hibernation_store:set(session.username, session.resumption_token, record);
+	if not ok then
+		session.log("error", "Unable to save session for resumption after restart: %s", err);
+		queue:restore(items);
+		return nil, err;
+	end
+	session_registry[registry_key(session)] = nil;
+	sessions_persisted(1);
+	return true;
+end
+
 local ack_errors = require"prosody.util.error".init("mod_smacks", xmlns_sm3, {
 	head = { condition = "undefined-condition"; text = "Client acknowledged more stanzas than sent by server" };
 	tail = { condition = "undefined-condition"; text = "Client acknowledged less stanzas than already acknowledged" };
@@ -131,7 +244,54 @@ local function ack_delayed(session, stanza)
 			session.outgoing_stanza_queue and session.outgoing_stanza_queue:count_unacked() or 0);
 		module:fire_event("smacks-ack-delayed", {origin = session, queue = session.outgoing_stanza_queue:table(), stanza = stanza});
 	end
-	session.delayed_ack_timer = nil;
+end
+
+-- Instead of a timer per <r/>, sessions awaiting an ack are put in
+-- one-second buckets by deadline, which a single timer works through.
+-- Answered requests are not removed, the deadline on the session is
+-- compared instead.
+local ack_deadlines = {};
+local ack_deadline_timer_running = false;
+
+local function check_ack_deadlines()
+	local now = os_time();
+	local due = {};
+	for deadline, sessions in pairs(ack_deadlines) do
+		if deadline <= now then
+			ack_deadlines[deadline] = nil;
+			due[deadline] = sessions;
+		end
+	end
+	for deadline, sessions in pairs(due) do
+		for session in pairs(sessions) do
+			if session.awaiting_ack_deadline == deadline then
+				session.awaiting_ack_deadline = nil;
+				ack_delayed(session, nil); -- we don't know if this is the only new stanza in the queue
+			end
+		end
+	end
+	if next(ack_deadlines) == nil then
+		ack_deadline_timer_running = false;
+		return;
+	end
+	ack_timer_operations(1);
+	return 1;
+end
+
+local function add_ack_deadline(session)
+	local deadline = os_time() + math.ceil(delayed_ack_timeout);
+	session.awaiting_ack_deadline = deadline;
+	local sessions = ack_deadlines[deadline];
+	if not sessions then
+		sessions = {};
+		ack_deadlines[deadline] = sessions;
+	end
+	sessions[session] = true;
+	if not ack_deadline_timer_running then
+		ack_deadline_timer_running = true;
+		ack_timer_operations(1);
+		timer.add_task(1, check_ack_deadlines);
+	end
 end
 
 local function can_do_smacks(session, advertise_only)
@@ -192,10 +352,9 @@ local function request_ack(session, reason)
 	if session.destroyed then return end -- sending something can trigger destruction
 	-- expected_h could be lower than this expression e.g. more stanzas added to the queue meanwhile)
 	session.last_requested_h = queue:count_acked() + queue:count_unacked();
-	if not session.delayed_ack_timer then
-		session.delayed_ack_timer = timer.add_task(delayed_ack_timeout, function()
-			ack_delayed(session, nil); -- we don't know if this is the only new stanza in the queue
-		end);
+	ack_requests_sent(1);
+	if delayed_ack_timeout > 0 and not session.awaiting_ack_deadline then
+		add_ack_deadline(session);
 	end
 end
 
@@ -205,6 +364,30 @@ local function request_ack_now_if_needed(session, force, reason)
 	end
 end
 
+-- Requests from queued stanzas are sent together on the next tick, so the
+-- <r/> goes out in the same write as the stanzas that triggered it
+local pending_ack_requests = {};
+local ack_flush_scheduled = false;
+
+local function flush_ack_requests()
+	ack_flush_scheduled = false;
+	local sessions = pending_ack_requests;
+	pending_ack_requests = {};
+	for session, reason in pairs(sessions) do
+		request_ack_now_if_needed(session, false, reason);
+	end
+end
+
+local function schedule_ack_request(session, reason)
+	if pending_ack_requests[session] then return end
+	pending_ack_requests[session] = reason;
+	if not ack_flush_scheduled then
+		ack_flush_scheduled = true;
+		ack_timer_operations(1);
+		timer.add_task(0, flush_ack_requests);
+	end
+end
+
 local function outgoing_stanza_filter(stanza, session)
 	-- XXX: Normally you wouldn't have to check the xmlns for a stanza as it's
 	-- supposed to be nil.
@@ -236,6 +419,9 @@ local function outgoing_stanza_filter(stanza, session)
 			module:fire_event("smacks-hibernation-stanza-queued", {origin = session, queue = queue:table(), stanza = cached_stanza});
 			return nil;
 		end
+		if should_ack(session) then
+			schedule_ack_request(session, "outgoing stanza");
+		end
 	end
 	return stanza;
 end
@@ -325,6 +511,19 @@ function do_enable(session, stanza)
 		elseif err then
 			session.log("error", "Unable to retrieve old resumption counters: %s", err);
 		end
+
+		if persistent_hibernation then
+			-- Forget sessions saved at shutdown or spilled before a crash that can no longer be resumed
+			local hibernated = all_hibernated_sessions:get(session.username);
+			if hibernated then
+				local now = os_time();
+				for token, record in pairs(hibernated) do
+					if now - (record.t or 0) > resume_timeout and not session_registry[registry_key(session, token)] then
+						hibernation_store:set(session.username, token, nil);
+					end
+				end
+			end
+		end
 	end
 
 	local resume_token;
@@ -423,10 +622,7 @@ function handle_a(origin, stanza)
 		timer.stop(origin.awaiting_ack_timer);
 		origin.awaiting_ack_timer = nil;
 	end
-	if origin.delayed_ack_timer then
-		timer.stop(origin.delayed_ack_timer)
-		origin.delayed_ack_timer = nil;
-	end
+	origin.awaiting_ack_deadline = nil;
 	-- Remove handled stanzas from outgoing_stanza_queue
 	local h = tonumber(stanza.attr.h);
 	if not h then
@@ -450,12 +646,14 @@ function handle_a(origin, stanza)
 
 	origin.log("debug", "#queue = %d (acked: %d)", queue:count_unacked(), handled_stanza_count);
 	request_ack_now_if_needed(origin, false, "handle_a", nil)
+	module:fire_event("smacks-ack-received", { origin = origin, acked = handled_stanza_count });
 	return true;
 end
 module:hook_tag(xmlns_sm2, "a", handle_a);
 module:hook_tag(xmlns_sm3, "a", handle_a);
 
 local function handle_unacked_stanzas(session)
+	unspill_queue(session);
 	local queue = session.outgoing_stanza_queue;
 	local unacked = queue:count_unacked()
 	if unacked > 0 then
@@ -559,6 +757,21 @@ module:hook("pre-resource-unbind", function (event)
 		session.conn = nil;
 		conn:close();
 	end
+	if persistent_hibernation then
+		local hibernating = session.hibernating;
+		module:add_timer(spill_delay, function ()
+			if session.hibernating ~= hibernating or not session.hibernating_watchdog or session.destroyed then
+				return;
+			end
+			session.thread:run({
+				event = "callback";
+				name = "mod_smacks/spill_queue";
+				callback = function ()
+					spill_queue(session);
+				end;
+			});
+		end);
+	end
 	session.log("debug", "Session going into hibernation (not being destroyed)")
 	module:fire_event("smacks-hibernation-start", { origin = session; queue = session.outgoing_stanza_queue:table() });
 	return true; -- Postpone destruction for now
@@ -583,6 +796,71 @@ end
 module:hook("s2sout-destroyed", handle_s2s_destroyed);
 module:hook("s2sin-destroyed", handle_s2s_destroyed);
 
+-- Resumes a session saved by a previous instance of the server
+local function resume_persisted(session, stanza, id)
+	local record, err = hibernation_store:get(session.username, id);
+	if not record then
+		if err then
+			session.log("error", "Unable to load saved session: %s", err);
+		end
+		return nil;
+	end
+	hibernation_store:set(session.username, id, nil);
+
+	if not record.persisted or os_time() - record.t > resume_timeout then
+		-- Either too old or left behind by a crash with only part of the queue
+		session.log("debug", "Tried to resume saved session with id %s that can't be restored", id);
+		resumption_expired(1);
+		return nil, enable_errors.new("expired", { h = record.h });
+	end
+
+	local queue = smqueue.new(queue_size, record.head, record.tail);
+	queue:restore(thaw_stanzas(session, record.stanzas));
+	local acked, ack_err = ack_errors.coerce(queue:ack(tonumber(stanza.attr.h))); -- luacheck: ignore 211/acked
+	if not ack_err and not queue:resumable() then
+		ack_err = ack_errors.new("overflow");
+	end
+	if ack_err then
+		session.log("debug", "Resumption failed: %s", ack_err);
+		return nil, ack_err;
+	end
+
+	local ok, bind_err = sessionmanager.bind_resource(session, record.resource);
+	if not ok then
+		session.log("debug", "Unable to rebind resource %q: %s", record.resource, bind_err);
+		return nil, enable_errors.new("unknown_session");
+	end
+
+	session.log("debug", "Resuming session %s saved before restart", id);
+	session.handled_stanza_count = record.h;
+	session.outgoing_stanza_queue = queue;
+	session.smacks = stanza.attr.xmlns;
+	session.interested = record.interested;
+	track_session(session, id);
+
+	return {
+		type = "resumed";
+		session = session;
+		id = id;
+		finish = function ()
+			for _, queued_stanza in queue:resume() do
+				session.send(queued_stanza);
+			end
+			wrap_session(session, true);
+			-- Tell contacts we're back, they saw us go offline at shutdown
+			if record.presence then
+				local presence = xml_parse(record.presence);
+				if presence then
+					prosody.core_process_stanza(session, presence);
+				end
+			end
+			module:fire_event("smacks-hibernation-end", {origin = session, resumed = session, queue = queue:table()});
+			request_ack_now_if_needed(session, true, "handle_resume", nil);
+			resumption_age:sample(os_time() - record.t);
+		end;
+	};
+end
+
 function do_resume(session, stanza)
 	if session.full_jid then
 		session.log("warn", "Tried to resume after resource binding");
@@ -596,6 +874,12 @@ function do_resume(session, stanza)
 		session_registry[registry_key(session, id)] = nil;
 		original_session = nil;
 	end
+	if not original_session and persistent_hibernation then
+		local resumed, err = resume_persisted(session, stanza, id);
+		if resumed or err then
+			return resumed, err;
+		end
+	end
 	if not original_session then
 		local old_session = old_session_registry:get(session.username, id);
 		if old_session then
@@ -608,6 +892,10 @@ function do_resume(session, stanza)
 		return nil, enable_errors.new("unknown_session");
 	end
 
+	if not unspill_queue(original_session) then
+		return nil, ack_errors.new("pop");
+	end
+
 	if original_session.hibernating_watchdog then
 		original_session.log("debug", "Letting the watchdog go");
 		original_session.hibernating_watchdog:cancel();
@@ -666,6 +954,7 @@ function do_resume(session, stanza)
 			-- Let everyone know that we are no longer hibernating
 			module:fire_event("smacks-hibernation-end", {origin = session, resumed = original_session, queue = queue:table()});
 			original_session.awaiting_ack = nil; -- Don't wait for acks from before the resumption
+			original_session.awaiting_ack_deadline = nil;
 			request_ack_now_if_needed(original_session, true, "handle_resume", nil);
 			resumption_age:sample(age);
 		end;
@@ -719,10 +1008,7 @@ local function handle_read_timeout(event)
 				timer.stop(session.awaiting_ack_timer);
 				session.awaiting_ack_timer = nil;
 			end
-			if session.delayed_ack_timer then
-				timer.stop(session.delayed_ack_timer);
-				session.delayed_ack_timer = nil;
-			end
+			session.awaiting_ack_deadline = nil;
 			return false; -- Kick the session
 		end
 		request_ack_now_if_needed(session, true, "read timeout");
@@ -746,11 +1032,16 @@ module:hook_global("server-stopping", function(event)
 	for _, user in pairs(local_sessions) do
 		for _, session in pairs(user.sessions) do
 			if session.resumption_token then
-				if save_old_session(session) then
+				local persisted = persistent_hibernation and persist_session(session);
+				if persisted or save_old_session(session) then
 					session.resumption_token = nil;
 
 					-- Deal with unacked stanzas
-					if session.outgoing_stanza_queue then
+					if persisted then
+						-- Saved along with the session, don't bounce them
+						session.outgoing_stanza_queue = nil;
+						session.smacks = false;
+					elseif session.outgoing_stanza_queue then
 						handle_unacked_stanzas(session);
 					end
 
@@ -0,0 +1,341 @@
+-- Read-through and write-through cache in front of another storage driver
+--
+-- storage = { roster = "cache", vcard = "cache", private = "cache" }
+-- storage_cache_backend = "sql"
+
+local cache = require "prosody.util.cache";
+local serialize = require "prosody.util.serialization".serialize;
+local deserialize = require "prosody.util.serialization".deserialize;
+local storagemanager = require "prosody.core.storagemanager";
+
+local backend_name = module:get_option_string("storage_cache_backend", module:get_option_string("default_storage", "internal"));
+local default_memory = module:get_option_integer("storage_cache_memory", 1024*1024, 1024);
+local store_memory = module:get_option("storage_cache_store_memory", {});
+local max_items = module:get_option_integer("storage_cache_max_items", 100000, 1);
+local negative_caching = module:get_option_boolean("storage_cache_negative", true);
+
+local lookups = module:metric("counter", "lookups", "", "Storage cache lookups", { "store", "result" });
+local evictions = module:metric("counter", "evictions", "", "Entries evicted from the storage cache", { "store" });
+local cached_memory = module:metric("gauge", "memory", "bytes", "Approximate memory used by cached data", { "store" });
+
+if backend_name == "cache" then
+	module:log("error", "storage_cache_backend can't be 'cache', using 'internal'");
+	backend_name = "internal";
+end
+
+local backend = storagemanager.load_driver(module.host, backend_name);
+if not backend then
+	error("Unable to load storage backend '"..backend_name.."'");
+end
+
+local NULL = {}; -- Key for host-wide data, where user is nil
+local ENTRY_OVERHEAD = 64; -- Rough size of the bookkeeping for each entry
+
+-- Entries are kept serialized, which is what their size is accounted by, and
+-- every reader gets a fresh copy it is free to modify
+local function decode(entry)
+	if entry.data then
+		return deserialize(entry.data);
+	end
+	return nil;
+end
+
+-- One LRU per store, bounded by both item count and approximate memory use
+local caches = setmetatable({}, {
+	__index = function (t, store_name)
+		local shard = {
+			name = store_name;
+			memory = 0;
+			budget = tonumber(store_memory[store_name]) or default_memory;
+			hits = lookups:with_labels(store_name, "hit");
+			misses = lookups:with_labels(store_name, "miss");
+			negative = lookups:with_labels(store_name, "negative");
+			evicted = evictions:with_labels(store_name);
+			size_gauge = cached_memory:with_labels(store_name);
+			-- For keys being read from or written to the backend, how many
+			-- such operations there are, and a count of writes to them
+			in_flight = {};
+			generations = {};
+			epoch = 0; -- Count of writes that may have touched every key
+		};
+		shard.items = cache.new(max_items, function (_, entry)
+			shard.memory = shard.memory - entry.size;
+			shard.evicted:add(1);
+		end);
+		t[store_name] = shard;
+		return shard;
+	end;
+});
+
+local function shard_remove(shard, key)
+	local entry = shard.items:get(key);
+	if entry then
+		shard.memory = shard.memory - entry.size;
+		shard.items:set(key, nil);
+		shard.size_gauge:set(shard.memory);
+	end
+end
+
+local function shard_set(shard, key, data)
+	shard_remove(shard, key);
+	local entry;
+	if data == nil then
+		if not negative_caching then return; end
+		entry = { size = ENTRY_OVERHEAD; data = false };
+	else
+		local serialized = serialize(data);
+		entry = { size = ENTRY_OVERHEAD + #serialized; data = serialized };
+	end
+	if entry.size > shard.budget then
+		return;
+	end
+	shard.items:set(key, entry);
+	shard.memory = shard.memory + entry.size;
+	while shard.memory > shard.budget do
+		local evicted_key, evicted_entry = shard.items:tail();
+		shard.memory = shard.memory - evicted_entry.size;
+		shard.items:set(evicted_key, nil);
+		shard.evicted:add(1);
+	end
+	shard.size_gauge:set(shard.memory);
+end
+
+local function shard_clear(shard)
+	shard.items:clear();
+	shard.memory = 0;
+	shard.size_gauge:set(0);
+end
+
+-- The backend may yield, so data read from it or written to it is only
+-- cached if nothing else wrote to the same key in the meantime
+
+local function begin_access(shard, key)
+	shard.in_flight[key] = (shard.in_flight[key] or 0) + 1;
+	return shard.generations[key] or 0, shard.epoch;
+end
+
+-- Returns whether the key was not written to since begin_access()
+local function end_access(shard, key, generation, epoch)
+	local unchanged = (shard.generations[key] or 0) == generation and shard.epoch == epoch;
+	local in_flight = shard.in_flight[key] - 1;
+	if in_flight == 0 then
+		in_flight = nil;
+		shard.generations[key] = nil;
+	end
+	shard.in_flight[key] = in_flight;
+	return unchanged;
+end
+
+local function written(shard, key)
+	if shard.in_flight[key] then
+		shard.generations[key] = (shard.generations[key] or 0) + 1;
+	end
+end
+
+-- Store objects forward anything not handled here to the backend store
+local function wrapper_mt(methods)
+	return {
+		__index = function (self, method_name)
+			local method = methods[method_name];
+			if method ~= nil then
+				return method;
+			end
+			local backend_store = self.backend;
+			local value = backend_store[method_name];
+			if type(value) == "function" then
+				return function (_, ...)
+					return value(backend_store, ...);
+				end
+			end
+			return value;
+		end;
+	};
+end
+
+local keyval = {};
+local keyval_mt = wrapper_mt(keyval);
+
+function keyval:get(username)
+	local shard, key = self.shard, username or NULL;
+	local entry = shard.items:get(key);
+	if entry then
+		if entry.data then
+			shard.hits:add(1);
+		else
+			shard.negative:add(1);
+		end
+		return decode(entry);
+	end
+	shard.misses:add(1);
+	local generation, epoch = begin_access(shard, key);
+	local data, err = self.backend:get(username);
+	local unchanged = end_access(shard, key, generation, epoch);
+	if data == nil and err then
+		return nil, err;
+	end
+	if unchanged then
+		shard_set(shard, key, data);
+	end
+	return data;
+end
+
+function keyval:get_many(usernames)
+	local shard = self.shard;
+	local results, missing = {}, {};
+	for _, username in ipairs(usernames) do
+		local entry = shard.items:get(username);
+		if entry then
+			if entry.data then
+				shard.hits:add(1);
+			else
+				shard.negative:add(1);
+			end
+			results[username] = decode(entry);
+		else
+			shard.misses:add(1);
+			missing[#missing+1] = username;
+		end
+	end
+	if missing[1] == nil then
+		return results;
+	end
+	local generations, epochs = {}, {};
+	for i, username in ipairs(missing) do
+		generations[i], epochs[i] = begin_access(shard, username);
+	end
+	local backend_store, loaded, err = self.backend, {}, nil;
+	local unchanged = {};
+	local function finish()
+		for i, username in ipairs(missing) do
+			unchanged[username] = end_access(shard, username, generations[i], epochs[i]);
+		end
+	end
+	if backend_store.get_many then
+		loaded, err = backend_store:get_many(missing);
+		if not loaded then
+			finish();
+			return nil, err;
+		end
+	else
+		for _, username in ipairs(missing) do
+			loaded[username], err = backend_store:get(username);
+			if loaded[username] == nil and err then
+				finish();
+				return nil, err;
+			end
+		end
+	end
+	finish();
+	for _, username in ipairs(missing) do
+		local data = loaded[username];
+		if unchanged[username] then
+			shard_set(shard, username, data);
+		end
+		results[username] = data;
+	end
+	return results;
+end
+
+function keyval:set(username, data)
+	local shard, key = self.shard, username or NULL;
+	-- Drop the old entry first, in case the backend yields
+	shard_remove(shard, key);
+	written(shard, key);
+	local generation, epoch = begin_access(shard, key);
+	local ok, err = self.backend:set(username, data);
+	local unchanged = end_access(shard, key, generation, epoch);
+	written(shard, key);
+	if ok and unchanged then
+		shard_set(shard, key, data);
+	else
+		-- Also drop anything read while the backend was being written to
+		shard_remove(shard, key);
+	end
+	return ok, err;
+end
+
+-- Map stores share the underlying data with keyval stores of the same name,
+-- so any change invalidates the cached keyval entry
+local map = {};
+local map_mt = wrapper_mt(map);
+
+local function map_write(shard, username, f, ...)
+	local key = username or NULL;
+	shard_remove(shard, key);
+	written(shard, key);
+	local ok, err = f(...);
+	-- Also drop anything read while the backend was being written to
+	written(shard, key);
+	shard_remove(shard, key);
+	return ok, err;
+end
+
+function map:set(username, key, data)
+	local backend_store = self.backend;
+	return map_write(self.shard, username, backend_store.set, backend_store, username, key, data);
+end
+
+function map:set_keys(username, keydatas)
+	local backend_store = self.backend;
+	return map_write(self.shard, username, backend_store.set_keys, backend_store, username, keydatas);
+end
+
+function map:delete_all(key)
+	local shard = self.shard;
+	shard_clear(shard);
+	shard.epoch = shard.epoch + 1;
+	local ok, err = self.backend:delete_all(key);
+	shard.epoch = shard.epoch + 1;
+	shard_clear(shard);
+	return ok, err;
+end
+
+local driver = {};
+
+function driver:open(store_name, typ) -- luacheck: ignore 212/self
+	local backend_store, err = backend:open(store_name, typ);
+	if not backend_store then
+		return backend_store, err;
+	end
+	if typ == nil or typ == "keyval" then
+		return setmetatable({ backend = backend_store; shard = caches[store_name] }, keyval_mt);
+	elseif typ == "map" then
+		return setmetatable({ backend = backend_store; shard = caches[store_name] }, map_mt);
+	end
+	-- Other store types are not cached
+	return backend_store;
+end
+
+function driver:stores(username) -- luacheck: ignore 212/self
+	return backend:stores(username);
+end
+
+function driver:purge(username) -- luacheck: ignore 212/self
+	for _, shard in pairs(caches) do
+		shard_remove(shard, username);
+		written(shard, username);
+	end
+	local ok, err = backend:purge(username);
+	for _, shard in pairs(caches) do
+		written(shard, username);
+		shard_remove(shard, username);
+	end
+	return ok, err;
+end
+
+module:add_item("shell-command", {
+	section = "storage";
+	section_desc = "Storage cache";
+	name = "cache_clear";
+	desc = "Clear the storage cache on a host";
+	args = { { name = "host", type = "string" } };
+	host_selector = "host";
+	handler = function(self, host) --luacheck: ignore 212/self 212/host
+		for _, shard in pairs(caches) do
+			shard_clear(shard);
+		end
+		return true, "Cleared";
+	end;
+});
+
+module:provides("storage", driver);
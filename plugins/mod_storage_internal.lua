@@ -8,6 +8,22 @@ local uuid_v7 = require "prosody.util.uuid".v7;
 local jid_join = require "prosody.util.jid".join;
 local set = require "prosody.util.set";
 local it = require "prosody.util.iterators";
+local envloadfile = require "prosody.util.envload".envloadfile;
+local serialize = require "prosody.util.serialization".serialize;
+local deserialize = require "prosody.util.serialization".deserialize;
+local async = require "prosody.util.async";
+
+local ENOENT = 2;
+local atomic_append = function (f, data)
+	local ok, err = f:write(data);
+	if ok then ok, err = f:flush(); end
+	return ok, err;
+end
+pcall(function()
+	local pposix = require "prosody.util.pposix";
+	ENOENT = pposix.ENOENT or ENOENT;
+	atomic_append = pposix.atomic_append or atomic_append;
+end);
 
 local host = module.host;
 
@@ -16,6 +32,21 @@ local archive_item_count_cache = cache.new(module:get_option_integer("storage_ar
 
 local use_shift = module:get_option_boolean("storage_archive_experimental_fast_delete", false);
 
+-- Position of each item by key, so that lookups and paging by id don't have
+-- to read through the whole archive. Only kept for larger archives.
+local key_index_cache = cache.new(module:get_option_integer("storage_archive_key_index_cache_size", 20, 1));
+local key_index_min_items = module:get_option_integer("storage_archive_key_index_min_items", 100, 1);
+
+-- Keyval stores that are written to an append-only log instead of rewriting a
+-- whole file per change, with changes applied to the normal files periodically
+local wal_stores = module:get_option_set("storage_internal_wal_stores", {});
+local wal_snapshot_interval = module:get_option_period("storage_internal_wal_snapshot_interval", "5m");
+local wal_snapshot_size = module:get_option_integer("storage_internal_wal_snapshot_size", 10000, 1);
+
+local measure_keyval_set = module:measure("keyval_set", "times");
+local keyval_writes = module:metric("counter", "keyval_writes", "", "Keyval store writes", { "method" });
+local keyval_snapshots = module:metric("counter", "keyval_snapshots", "", "Keyval log snapshots written", {}):with_labels();
+
 local driver = {};
 
 function driver:open(store, typ)
@@ -23,6 +54,9 @@ function driver:open(store, typ)
 	if not mt then
 		return nil, "unsupported-store";
 	end
+	if mt == self.keyval and wal_stores:contains(store) then
+		mt = self.wal_keyval_mt;
+	end
 	return setmetatable({ store = store, type = typ }, mt);
 end
 
@@ -41,14 +75,334 @@ function keyval:get(user)
 	return datamanager.load(user, host, self.store);
 end
 
+function keyval:get_many(users)
+	return datamanager.load_many(users, host, self.store);
+end
+
 function keyval:set(user, data)
-	return datamanager.store(user, host, self.store, data);
+	local done = measure_keyval_set();
+	keyval_writes:with_labels("file"):add(1);
+	local ok, err = datamanager.store(user, host, self.store, data);
+	done();
+	return ok, err;
 end
 
 function keyval:users()
 	return datamanager.users(host, self.store, self.type);
 end
 
+-- Write-ahead logged keyval stores
+--
+-- Changes are appended to a per-host log and kept in memory until the next
+-- snapshot, which writes them out to the regular per-user files and starts
+-- a fresh log. Any log left behind (e.g. after a crash) is applied on load.
+
+local wal_keyval = setmetatable({}, { __index = keyval });
+driver.wal_keyval_mt = { __index = wal_keyval }; -- Not directly openable, see driver:open()
+
+local no_user = {}; -- Key for host-wide data, where user is nil
+local deleted = {}; -- Marker for removed data, which must shadow older files
+
+-- Changes are kept serialized, so that callers can't modify them by
+-- changing a table they passed to :set() or got from :get()
+local wal_changes = {}; -- Changes since the current log was started, [store][user] = serialized data
+local wal_snapshotting = {}; -- Changes being written out by a snapshot in progress
+local wal_change_count = 0;
+local wal_fh;
+local snapshot_scheduled;
+
+local function wal_path(ext)
+	return datamanager.getpath(nil, host, "keyval", ext, true);
+end
+
+local function wal_lookup(changes, store, user)
+	local store_changes = changes[store];
+	return store_changes and store_changes[user or no_user];
+end
+
+local function wal_record(changes, store, user, data)
+	local store_changes = changes[store];
+	if not store_changes then
+		store_changes = {};
+		changes[store] = store_changes;
+	end
+	store_changes[user or no_user] = data or deleted;
+end
+
+local function wal_data(data)
+	if data == deleted then
+		return nil;
+	end
+	return deserialize(data);
+end
+
+-- Writes changes to the regular files, returns a table of changes that failed
+local function wal_apply(changes)
+	local failed;
+	for store, store_changes in pairs(changes) do
+		for user_key, data in pairs(store_changes) do
+			local user = user_key ~= no_user and user_key or nil;
+			keyval_writes:with_labels("snapshot"):add(1);
+			if not datamanager.store(user, host, store, wal_data(data)) then
+				failed = failed or {};
+				wal_record(failed, store, user, data);
+			end
+		end
+	end
+	return failed;
+end
+
+-- Log entry for a change, with data already serialized
+local function wal_entry(store, user, data)
+	return ("item({ store = %s; user = %s; data = %s });\n"):format(serialize(store), serialize(user), data or "nil");
+end
+
+-- Reads a log file into a table of changes
+local function wal_read(filename, changes)
+	local f, err, errno = envloadfile(filename, {
+		item = function (entry)
+			wal_record(changes, entry.store, entry.user, entry.data ~= nil and serialize(entry.data) or nil);
+		end;
+	});
+	if not f then
+		if errno ~= ENOENT then
+			module:log("error", "Could not read keyval log %s: %s", filename, err);
+			return nil, err;
+		end
+		return changes;
+	end
+	local ok, err = pcall(f);
+	if not ok then
+		-- Most likely a partially written last entry, everything before it is still usable
+		module:log("warn", "Keyval log %s ended unexpectedly: %s", filename, err);
+	end
+	return changes;
+end
+
+local function wal_open()
+	local err;
+	wal_fh, err = io.open(wal_path("wal"), "a");
+	if not wal_fh then
+		module:log("error", "Could not open keyval log, falling back to direct writes: %s", err);
+	end
+	return wal_fh;
+end
+
+-- Starts a new log, keeping the old one around until the snapshot is complete
+local function wal_rotate(log_file, old_log_file)
+	local old_log = io.open(old_log_file, "r");
+	if not old_log then
+		return os.rename(log_file, old_log_file);
+	end
+	old_log:close();
+	-- An earlier snapshot could not be completed, so everything in the old log
+	-- still needs to be there, followed by the more recent changes
+	local f, err = io.open(log_file, "r");
+	if not f then
+		return nil, err;
+	end
+	local recent;
+	recent, err = f:read("*a");
+	f:close();
+	if not recent then
+		return nil, err;
+	end
+	old_log, err = io.open(old_log_file, "a");
+	if not old_log then
+		return nil, err;
+	end
+	local ok;
+	ok, err = atomic_append(old_log, recent);
+	old_log:close();
+	if not ok then
+		return nil, err;
+	end
+	return os.remove(log_file);
+end
+
+local function snapshot()
+	snapshot_scheduled = nil;
+	if wal_change_count == 0 or next(wal_snapshotting) then
+		return;
+	end
+	module:log("debug", "Writing snapshot of %d keyval log entries", wal_change_count);
+
+	-- Start a new log for changes made while the snapshot is being written
+	if wal_fh then
+		wal_fh:close();
+	end
+	local log_file, old_log_file = wal_path("wal"), wal_path("wal~");
+	local renamed, err = wal_rotate(log_file, old_log_file);
+	if not renamed then
+		module:log("error", "Could not rotate keyval log: %s", err);
+		wal_open();
+		return;
+	end
+	wal_open();
+
+	wal_snapshotting, wal_changes, wal_change_count = wal_changes, {}, 0;
+	local failed = wal_apply(wal_snapshotting);
+	wal_snapshotting = {};
+	local keep_old_log = false;
+	if failed then
+		-- Carry failed entries over into the new log, unless superseded by now
+		for store, store_changes in pairs(failed) do
+			for user_key, data in pairs(store_changes) do
+				local user = user_key ~= no_user and user_key or nil;
+				if wal_lookup(wal_changes, store, user) == nil then
+					module:log("warn", "Could not write %s data for %s, retrying later", store, user or host);
+					if not keep_old_log and not (wal_fh and atomic_append(wal_fh, wal_entry(store, user, data ~= deleted and data or nil))) then
+						-- Keep the old log, to be applied again on next load or
+						-- merged into by the next snapshot
+						module:log("error", "Failed to carry over keyval log entries, keeping %s", old_log_file);
+						keep_old_log = true;
+					end
+					wal_record(wal_changes, store, user, data);
+					wal_change_count = wal_change_count + 1;
+				end
+			end
+		end
+	end
+	if not keep_old_log then
+		os.remove(old_log_file);
+	end
+	keyval_snapshots:add(1);
+end
+
+-- datamanager may yield when using asynchronous file I/O
+local snapshot_runner = async.runner(snapshot);
+
+local function schedule_snapshot(delay)
+	if not snapshot_scheduled then
+		snapshot_scheduled = module:add_timer(delay, function ()
+			snapshot_runner:run(true);
+		end);
+	end
+end
+
+function wal_keyval:get(user)
+	local data = wal_lookup(wal_changes, self.store, user) or wal_lookup(wal_snapshotting, self.store, user);
+	if data ~= nil then
+		return wal_data(data);
+	end
+	return keyval.get(self, user);
+end
+
+function wal_keyval:get_many(users)
+	local results, missing = {}, {};
+	for _, user in ipairs(users) do
+		local data = wal_lookup(wal_changes, self.store, user) or wal_lookup(wal_snapshotting, self.store, user);
+		if data == nil then
+			missing[#missing+1] = user;
+		elseif data ~= deleted then
+			results[user] = wal_data(data);
+		end
+	end
+	if missing[1] == nil then
+		return results;
+	end
+	local loaded, err = keyval.get_many(self, missing);
+	if not loaded then
+		return nil, err;
+	end
+	for user, data in pairs(loaded) do
+		results[user] = data;
+	end
+	return results;
+end
+
+function wal_keyval:set(user, data)
+	if not wal_fh then
+		return keyval.set(self, user, data);
+	end
+	local done = measure_keyval_set();
+	local serialized = data ~= nil and serialize(data) or nil;
+	local ok, err = atomic_append(wal_fh, wal_entry(self.store, user, serialized));
+	done();
+	if not ok then
+		module:log("error", "Failed to append to keyval log: %s", err);
+		return keyval.set(self, user, data);
+	end
+	keyval_writes:with_labels("wal"):add(1);
+	wal_record(wal_changes, self.store, user, serialized);
+	wal_change_count = wal_change_count + 1;
+	if wal_change_count >= wal_snapshot_size then
+		schedule_snapshot(0);
+	end
+	return true;
+end
+
+function wal_keyval:users()
+	-- Users with only unsnapshotted changes have no file yet
+	local users = set.new();
+	for user in keyval.users(self) do
+		users:add(user);
+	end
+	for _, changes in ipairs({ wal_snapshotting, wal_changes }) do
+		for user, data in pairs(changes[self.store] or {}) do
+			if user ~= no_user then
+				if data == deleted then
+					users:remove(user);
+				else
+					users:add(user);
+				end
+			end
+		end
+	end
+	return users:items();
+end
+
+if not wal_stores:empty() then
+	-- Apply whatever was left over from before, oldest first
+	local leftovers = {};
+	local old_log_file, log_file = wal_path("wal~"), wal_path("wal");
+	if wal_read(old_log_file, leftovers) and wal_read(log_file, leftovers) and next(leftovers) then
+		module:log("info", "Applying changes from keyval log");
+		local failed = wal_apply(leftovers);
+		if failed then
+			-- Leave the logs in place and keep serving the changes from memory
+			module:log("error", "Some changes from the keyval log could not be applied");
+			wal_changes = leftovers;
+			for _, store_changes in pairs(leftovers) do
+				for _ in pairs(store_changes) do
+					wal_change_count = wal_change_count + 1;
+				end
+			end
+		else
+			os.remove(old_log_file);
+			os.remove(log_file);
+		end
+	end
+
+	wal_open();
+
+	-- Pending changes would otherwise bring back purged data on the next snapshot
+	local purge_files = driver.purge;
+	function driver:purge(user)
+		for _, changes in ipairs({ wal_snapshotting, wal_changes }) do
+			for store, store_changes in pairs(changes) do
+				if store_changes[user] ~= nil then
+					wal_keyval.set({ store = store }, user, nil);
+				end
+			end
+		end
+		return purge_files(self, user);
+	end
+
+	module:add_timer(wal_snapshot_interval, function ()
+		schedule_snapshot(0);
+		return wal_snapshot_interval;
+	end);
+
+	function module.unload()
+		snapshot();
+		if wal_fh then
+			wal_fh:close();
+			wal_fh = nil;
+		end
+	end
+end
+
 local archive = {};
 driver.archive = { __index = archive };
 
@@ -60,6 +414,48 @@ archive.caps = {
 	ids = true;
 };
 
+-- Returns key -> position for the items in an open list, or nil if it is too
+-- small to bother. Indexes are checked against the number of items, and
+-- updated or dropped by everything writing to the archive.
+local function get_key_index(cache_key, list)
+	local count = #list;
+	local index = key_index_cache:get(cache_key);
+	if index and index.count == count then
+		return index.positions;
+	end
+	if count < key_index_min_items then
+		return nil;
+	end
+	local positions = {};
+	for i = 1, count do
+		local item = list[i];
+		if item and item.key then
+			positions[item.key] = i;
+		end
+	end
+	key_index_cache:set(cache_key, { count = count; positions = positions });
+	return positions;
+end
+
+-- Called with the new items after rewriting an archive
+local function reindex_keys(cache_key, items)
+	local index = key_index_cache:get(cache_key);
+	if not index then
+		return;
+	end
+	if not items then
+		key_index_cache:set(cache_key, nil);
+		return;
+	end
+	local positions = {};
+	for i, item in ipairs(items) do
+		if item.key then
+			positions[item.key] = i;
+		end
+	end
+	index.count, index.positions = #items, positions;
+end
+
 function archive:append(username, key, value, when, with)
 	when = when or now();
 	if not st.is_stanza(value) then
@@ -95,8 +491,12 @@ function archive:append(username, key, value, when, with)
 			value.key = key;
 			items:push(value);
 			local ok, err = datamanager.list_store(username, host, self.store, items);
-			if not ok then return ok, err; end
+			if not ok then
+				reindex_keys(cache_key, nil);
+				return ok, err;
+			end
 			archive_item_count_cache:set(cache_key, #items);
+			reindex_keys(cache_key, items);
 			return key;
 		end
 	else
@@ -119,8 +519,17 @@ function archive:append(username, key, value, when, with)
 	value.key = key;
 
 	local ok, err = datamanager.list_append(username, host, self.store, value);
-	if not ok then return ok, err; end
+	if not ok then
+		reindex_keys(cache_key, nil);
+		return ok, err;
+	end
 	archive_item_count_cache:set(cache_key, item_count+1);
+	local index = key_index_cache:get(cache_key);
+	if index then
+		-- If the index was stale, the count won't match and it gets rebuilt
+		index.count = index.count + 1;
+		index.positions[key] = index.count;
+	end
 	return key;
 end
 
@@ -182,6 +591,36 @@ function archive:find(username, query)
 			end
 			query.before, query.after = query.after, query.before;
 		end
+		-- Jump straight to the items asked for, if the archive is indexed
+		local positions = (query.key or query.after or query.before) and get_key_index(jid_join(username, host, self.store), list);
+		if positions and query.key then
+			local pos = positions[query.key];
+			local done = pos == nil;
+			iter = function ()
+				if done then return nil; end
+				done = true;
+				i = pos;
+				return list[pos];
+			end
+		end
+		if positions and query.after and positions[query.after] then
+			-- Iteration starts after the anchor, whichever direction it goes in
+			i = positions[query.after];
+			query = setmetatable({ after = false }, { __index = query });
+		end
+		if positions and query.before and positions[query.before] then
+			local stop_at, base_iter, done = positions[query.before], iter, false;
+			iter = function ()
+				if done then return nil; end
+				local item = base_iter();
+				if i == stop_at then
+					done = true;
+					return nil;
+				end
+				return item;
+			end
+			query = setmetatable({ before = false }, { __index = query });
+		end
 		if query.key then
 			iter = it.filter(function(item)
 				return item.key == query.key;
@@ -204,7 +643,7 @@ function archive:find(username, query)
 					local when = item.when or datetime.parse(item.attr.stamp);
 					return query.start - when;
 				end);
-				i = wi - 1;
+				i = math.max(i, wi - 1);
 			end
 			iter = it.filter(function(item)
 				local when = item.when or datetime.parse(item.attr.stamp);
@@ -218,7 +657,7 @@ function archive:find(username, query)
 					return query["end"] - when;
 				end);
 				if wi then
-					i = wi + 1;
+					i = math.min(i, wi + 1);
 				end
 			end
 			iter = it.filter(function(item)
@@ -359,6 +798,7 @@ function archive:trim(username, to_when)
 		if list.close then
 			list:close()
 		end
+		reindex_keys(cache_key, nil);
 		return datamanager.list_store(username, host, self.store, nil);
 	end
 
@@ -372,6 +812,7 @@ function archive:trim(username, to_when)
 	end
 	-- TODO if exact then ... off by one?
 	if i == 1 then return 0; end
+	reindex_keys(cache_key, nil);
 	local ok, err = datamanager.list_shift(username, host, self.store, i);
 	if not ok then return ok, err; end
 	archive_item_count_cache:set(cache_key, nil); -- TODO calculate how many items are left
@@ -382,6 +823,7 @@ function archive:delete(username, query)
 	local cache_key = jid_join(username, host, self.store);
 	if not query or next(query) == nil then
 		archive_item_count_cache:set(cache_key, nil); -- nil because we don't check if the following succeeds
+		reindex_keys(cache_key, nil);
 		return datamanager.list_store(username, host, self.store, nil);
 	end
 
@@ -443,8 +885,12 @@ function archive:delete(username, query)
 		return 0; -- No changes, skip write
 	end
 	local ok, err = datamanager.list_store(username, host, self.store, items);
-	if not ok then return ok, err; end
+	if not ok then
+		reindex_keys(cache_key, nil);
+		return ok, err;
+	end
 	archive_item_count_cache:set(cache_key, #items);
+	reindex_keys(cache_key, items);
 	return count;
 end
 
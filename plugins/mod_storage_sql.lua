@@ -118,6 +118,47 @@ local function keyval_store_get(user, store)
 		return result;
 	end
 end
+
+-- Keep well below the smallest limit on bound parameters (999 in older SQLite)
+local max_users_per_query = 500;
+
+local function placeholders(n)
+	return ("?,"):rep(n-1) .. "?";
+end
+
+local function keyval_store_get_many(usernames, store)
+	local results = {};
+	for first = 1, #usernames, max_users_per_query do
+		local last = math.min(first + max_users_per_query - 1, #usernames);
+		local select_sql = [[
+		SELECT "user","key","type","value"
+		FROM "prosody"
+		WHERE "host"=? AND "store"=? AND "user" IN (]] .. placeholders(last-first+1) .. [[);
+		]];
+		local args = { host, store };
+		for i = first, last do
+			args[#args+1] = usernames[i] or "";
+		end
+		for row in engine:select(select_sql, unpack(args)) do
+			local result = results[row[1]];
+			if not result then
+				result = {};
+				results[row[1]] = result;
+			end
+			local k = row[2];
+			local v, e = deserialize(row[3], row[4]);
+			assert(v ~= nil, e);
+			if k and v then
+				if k ~= "" then result[k] = v; elseif type(v) == "table" then
+					for a,b in pairs(v) do
+						result[a] = b;
+					end
+				end
+			end
+		end
+	end
+	return results;
+end
 local function keyval_store_set(data, user, store)
 	local delete_sql = [[
 	DELETE FROM "prosody"
@@ -160,6 +201,14 @@ function keyval_store:get(username)
 	end
 	return result;
 end
+function keyval_store:get_many(usernames)
+	local ok, result = engine:transaction(keyval_store_get_many, usernames, self.store);
+	if not ok then
+		module:log("error", "Unable to read from database %s store for %d users: %s", self.store, #usernames, result);
+		return nil, result;
+	end
+	return result;
+end
 function keyval_store:set(username, data)
 	return engine:transaction(keyval_store_set, data, username, self.store);
 end
@@ -214,6 +263,40 @@ function map_store:get(username, key)
 	if not ok then return nil, result; end
 	return result;
 end
+function map_store:get_many(usernames, key)
+	if type(key) ~= "string" or key == "" then
+		-- Stored together with other keys, so fetch the lot
+		local results, err = keyval_store.get_many(self, usernames);
+		if not results then return nil, err; end
+		for username, data in pairs(results) do
+			results[username] = data[key];
+		end
+		return results;
+	end
+	local ok, result = engine:transaction(function()
+		local results = {};
+		for first = 1, #usernames, max_users_per_query do
+			local last = math.min(first + max_users_per_query - 1, #usernames);
+			local query = [[
+			SELECT "user", "type", "value"
+			FROM "prosody"
+			WHERE "host"=? AND "store"=? AND "key"=? AND "user" IN (]] .. placeholders(last-first+1) .. [[)
+			]];
+			local args = { host, self.store, key };
+			for i = first, last do
+				args[#args+1] = usernames[i] or "";
+			end
+			for row in engine:select(query, unpack(args)) do
+				local data, err = deserialize(row[2], row[3]);
+				assert(data ~= nil, err);
+				results[row[1]] = data;
+			end
+		end
+		return results;
+	end);
+	if not ok then return nil, result; end
+	return result;
+end
 function map_store:set(username, key, data)
 	if data == nil then data = self.remove; end
 	return self:set_keys(username, { [key] = data });
@@ -704,10 +787,12 @@ local keyvalplus = {
 	__index = {
 		-- keyval
 		get = keyval_store.get;
+		get_many = keyval_store.get_many;
 		set = keyval_store.set;
 		items = keyval_store.users;
 		-- map
 		get_key = map_store.get;
+		get_key_from_many = map_store.get_many;
 		set_key = map_store.set;
 		remove = map_store.remove;
 		set_keys = map_store.set_keys;
@@ -582,10 +582,24 @@ handlers.pep_ = {
 
 -- MAM archives
 local xmlns_pie_mam = "urn:xmpp:pie:0#mam";
+
+-- Rewriting the whole user file for every appended item makes importing
+-- large archives quadratic, so the migrator keeps the document in memory
+-- and writes it out every so many items, and whenever it calls :flush().
+-- Documents are kept per user, since the migrator may be appending for
+-- several users at once, each of which may wait for I/O in between.
+local archive_write_chunk = module:get_option_integer("storage_xep0227_archive_write_chunk",
+	prosody.process_type == "migrator" and 1000 or 1, 1);
+
 handlers.archive = {
 	find = function (self, user, query)
 		assert(query == nil, "XEP-0313 queries are not supported on XEP-0227 files");
 
+		local ok, err = self:flush(user);
+		if not ok then
+			return nil, err;
+		end
+
 		local xml = self:_get_user_xml(user, self.host);
 		local user_el = xml and getUserElement(xml);
 		if not user_el then
@@ -617,7 +631,8 @@ handlers.archive = {
 		end;
 	end;
 	append = function (self, user, key, payload, when, with) --luacheck: ignore 212/when 212/with 212/key
-		local xml = self:_get_user_xml(user, self.host);
+		local pending = self._pending[user];
+		local xml = pending and pending.xml or self:_get_user_xml(user, self.host);
 		local user_el = xml and getUserElement(xml);
 		if not user_el then
 			return true;
@@ -642,7 +657,40 @@ handlers.archive = {
 		-- Append item to archive_el
 		archive_el:add_child(result_el);
 
-		return self:_set_user_xml(user, self.host, xml);
+		if not pending then
+			pending = { xml = xml; count = 0 };
+			self._pending[user] = pending;
+		end
+		pending.count = pending.count + 1;
+		if pending.count >= archive_write_chunk then
+			return self:flush(user);
+		end
+		return true;
+	end;
+	-- Writes out the buffered document of the user, or of everyone
+	flush = function (self, user)
+		if user == nil then
+			local users = {};
+			for pending_user in pairs(self._pending) do
+				users[#users+1] = pending_user;
+			end
+			for _, pending_user in ipairs(users) do
+				local ok, err = self:flush(pending_user);
+				if not ok then
+					return ok, err;
+				end
+			end
+			return true;
+		end
+		local pending = self._pending[user];
+		if not pending then
+			return true;
+		end
+		self._pending[user] = nil;
+		return self:_set_user_xml(user, self.host, pending.xml);
+	end;
+	init = function (self)
+		self._pending = {};
 	end;
 };
 
@@ -7,6 +7,7 @@ local usermanager = require "prosody.core.usermanager";
 local generate_identifier = require "prosody.util.id".short;
 
 local token_store = module:open_store("auth_tokens", "keyval+");
+local token_hasher = hashes.new("sha256");
 
 local access_time_granularity = module:get_option_period("token_auth_access_time_granularity", 60);
 local empty_grant_lifetime = module:get_option_period("tokenless_grant_ttl", "2w");
@@ -105,7 +106,7 @@ function create_token(grant_jid, grant, token_role, token_ttl, token_purpose, to
 	};
 
 	local token_secret = random.bytes(18);
-	grant.tokens["sha256:"..hashes.sha256(token_secret, true)] = token_info;
+	grant.tokens["sha256:"..token_hasher:digest(token_secret, true)] = token_info;
 
 	local ok, err = token_store:set_key(grant_username, grant.id, grant);
 	if not ok then
@@ -203,7 +204,7 @@ local function _get_validated_token_info(token_id, token_user, token_host, token
 	end
 
 	-- Check provided secret
-	local secret_hash = "sha256:"..hashes.sha256(token_secret, true);
+	local secret_hash = "sha256:"..token_hasher:digest(token_secret, true);
 	local token_info = grant.tokens[secret_hash];
 	if not token_info then
 		module:log("debug", "No tokens matched the given secret");
@@ -300,7 +301,7 @@ function revoke_token(token)
 	end
 	local grant, err = _get_validated_grant_info(token_user, grant_id);
 	if not grant then return grant, err; end
-	local secret_hash = "sha256:"..hashes.sha256(token_secret, true);
+	local secret_hash = "sha256:"..token_hasher:digest(token_secret, true);
 	local token_info = grant.tokens[secret_hash];
 	if not grant or not token_info then
 		return nil, "item-not-found";
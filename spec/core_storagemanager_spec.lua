@@ -20,6 +20,14 @@ local configs = {
 	internal = {
 		storage = "internal";
 	};
+	cache = {
+		storage = "cache";
+		storage_cache_backend = "memory";
+	};
+	internal_wal = {
+		storage = "internal";
+		storage_internal_wal_stores = { "test"; "test-map"; "test-kv+" };
+	};
 	sqlite = {
 		storage = "sql";
 		sql = { driver = "SQLite3", database = "prosody-tests.sqlite" };
@@ -85,6 +93,25 @@ describe("storagemanager", function ()
 					assert.same(simple_data, assert(store:get("user9999")));
 				end);
 
+				it("keeps its own copy of the data", function ()
+					local data = { foo = "bar" };
+					assert(store:set("user9996", data));
+					data.foo = "changed";
+					assert.same({ foo = "bar" }, assert(store:get("user9996")));
+					assert(store:get("user9996")).foo = "changed";
+					assert.same({ foo = "bar" }, assert(store:get("user9996")));
+					assert(store:set("user9996", nil));
+				end);
+
+				it("may get data for several users at once", function ()
+					assert(store:set("user9998", { foo = "baz" }));
+					assert.same({
+						user9999 = simple_data;
+						user9998 = { foo = "baz" };
+					}, assert(store:get_many({ "user9999", "user9998", "user9997" })));
+					assert(store:set("user9998", nil));
+				end);
+
 				it("may remove data for a user", function ()
 					assert(store:set("user9999", nil));
 					local ret, err = store:get("user9999");
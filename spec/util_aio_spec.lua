@@ -0,0 +1,111 @@
+describe("util.aio", function ()
+	local aio, poll;
+	setup(function ()
+		aio = require "util.aio";
+		poll = require "util.poll";
+	end);
+
+	local function collect(pool)
+		local p = poll.new();
+		assert.truthy(p:add(pool:getfd(), true, false));
+		assert.is_number(p:wait(5));
+		p:del(pool:getfd());
+		local results = {};
+		for id, ok, ret, errno, op in pool:completed() do
+			results[id] = { ok = ok; ret = ret; errno = errno; op = op };
+		end
+		return results;
+	end
+
+	local function wait_for(pool, id)
+		local result;
+		repeat
+			result = collect(pool)[id];
+		until result;
+		return result;
+	end
+
+	local filename = os.tmpname();
+	teardown(function ()
+		os.remove(filename);
+		os.remove(filename .. "~");
+	end);
+
+	it("has a constructor", function ()
+		assert.is_function(aio.new);
+		local pool = aio.new(1);
+		assert.truthy(pool);
+		assert.is_number(pool:getfd());
+		assert.truthy(pool:close());
+	end);
+
+	it("stores and reads files", function ()
+		local pool = aio.new(2);
+		local id = pool:store(filename, "hello world");
+		assert.is_number(id);
+		local result = wait_for(pool, id);
+		assert.truthy(result.ok);
+		assert.equal("store", result.op);
+
+		id = pool:read(filename);
+		result = wait_for(pool, id);
+		assert.truthy(result.ok);
+		assert.equal("hello world", result.ret);
+
+		assert.is_nil(io.open(filename .. "~"));
+		pool:close();
+	end);
+
+	it("reports errors", function ()
+		local pool = aio.new(1);
+		local id = pool:read(filename .. ".does-not-exist");
+		local result = wait_for(pool, id);
+		assert.falsy(result.ok);
+		assert.is_string(result.ret);
+		assert.equal(aio.ENOENT, result.errno);
+		pool:close();
+	end);
+
+	it("derives keys with PBKDF2", function ()
+		local pool = aio.new(2);
+		-- RFC 6070 test vector
+		local id = pool:pbkdf2("sha1", "password", "salt", 4096);
+		local result = wait_for(pool, id);
+		assert.truthy(result.ok);
+		assert.equal("pbkdf2", result.op);
+		assert.equal("4b007901b765489abead49d926f721d065a429c1", (result.ret:gsub(".", function (c)
+			return ("%02x"):format(c:byte());
+		end)));
+		assert.has_error(function () pool:pbkdf2("md5", "password", "salt", 1); end);
+		assert.has_error(function () pool:pbkdf2("sha256", "password", "salt", 0); end);
+		pool:close();
+	end);
+
+	it("runs jobs on the same file in order", function ()
+		local pool = aio.new(4);
+		for i = 1, 20 do
+			pool:store(filename, ("x"):rep(i));
+		end
+		local id = pool:read(filename);
+		local result = wait_for(pool, id);
+		assert.truthy(result.ok);
+		assert.equal(("x"):rep(20), result.ret);
+		pool:close();
+	end);
+
+	it("finishes queued jobs on close", function ()
+		local pool = aio.new(1);
+		local ids = {};
+		for i = 1, 10 do
+			ids[i] = pool:store(filename, ("x"):rep(i));
+		end
+		pool:close();
+		local done = {};
+		for id, ok in pool:completed() do
+			done[id] = ok;
+		end
+		for i = 1, 10 do
+			assert.truthy(done[ids[i]]);
+		end
+	end);
+end);
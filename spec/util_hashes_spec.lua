@@ -108,3 +108,44 @@ describe("HKDF", function ()
 		end);
 	end);
 end);
+
+describe("hasher", function ()
+	it("matches the one-shot functions", function ()
+		local h = hashes.new("sha256");
+		assert.equal(hashes.sha256("hello world", true), h:update("hello", " ", "world"):final(true));
+		-- Resets after final()
+		assert.equal(hashes.sha256("hello"), h:update("hello"):final());
+		assert.equal(hashes.sha256(""), h:final());
+		assert.equal(hashes.sha1("abc"), hashes.new("sha1"):digest("abc"));
+	end);
+
+	it("can be reset", function ()
+		local h = hashes.new("sha512");
+		h:update("discarded");
+		h:reset();
+		assert.equal(hashes.sha512("kept"), h:update("kept"):final());
+	end);
+
+	it("supports HMAC", function ()
+		local h = hashes.new("sha256", "key");
+		local msg = "The quick brown fox jumps over the lazy dog";
+		assert.equal("f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8", h:digest(msg, true));
+		assert.equal(hashes.hmac_sha256("key", msg), h:update("The quick brown fox ", "jumps over the lazy dog"):final());
+		-- Keys longer than the block size are hashed first
+		local long_key = ("k"):rep(200);
+		assert.equal(hashes.hmac_sha1(long_key, msg), hashes.new("sha1", long_key):digest(msg));
+	end);
+
+	it("hashes in batches", function ()
+		local h = hashes.new("sha1");
+		local digests = h:digest_many({ "a", "b", "" }, true);
+		assert.same({ hashes.sha1("a", true), hashes.sha1("b", true), hashes.sha1("", true) }, digests);
+		assert.same({}, h:digest_many({}));
+		assert.has_error(function () h:digest_many({ "a", {} }); end);
+		assert.same({ hashes.hmac_sha256("key", "a") }, hashes.new("sha256", "key"):digest_many({ "a" }));
+	end);
+
+	it("rejects unknown digests", function ()
+		assert.has_error(function () hashes.new("sha0"); end);
+	end);
+end);
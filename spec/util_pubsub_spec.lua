@@ -460,6 +460,55 @@ describe("util.pubsub", function ()
 			assert.is_true(ok);
 			assert.same({ { node = "test", jid = "someone", subscription = true, } }, ret);
 		end);
+
+		it("opens item stores when first needed", function ()
+			local opened = {};
+			local lazy_service = pubsub.new({
+				nodestore = nodestore;
+				itemstore = function (config, node_name)
+					table.insert(opened, node_name);
+					return require "util.cache".new(config["max_items"]);
+				end;
+			});
+			assert.same({}, opened);
+			assert.truthy(lazy_service:get_items("test", true));
+			assert.truthy(lazy_service:get_items("test", true));
+			assert.same({ "test" }, opened);
+		end);
+
+		local function lazy_store_service()
+			local stored = {
+				data = { test = { name = "test"; config = {}; affiliations = {}; subscribers = {} } };
+			};
+			function stored:users() return pairs(self.data); end
+			function stored:get(key) return self.data[key]; end
+			function stored:set(key, value) self.data[key] = value; return true; end
+			local cleared = {};
+			local lazy_service = pubsub.new({
+				nodestore = stored;
+				itemstore = function (config, node_name)
+					local items = require "util.cache".new(config["max_items"]);
+					function items:clear()
+						table.insert(cleared, node_name);
+						return true;
+					end
+					return items;
+				end;
+			});
+			return lazy_service, cleared;
+		end
+
+		it("clears item stores that were never opened when deleting the node", function ()
+			local lazy_service, cleared = lazy_store_service();
+			assert.truthy(lazy_service:delete("test", true));
+			assert.same({ "test" }, cleared);
+		end);
+
+		it("clears item stores that were never opened when items stop being persisted", function ()
+			local lazy_service, cleared = lazy_store_service();
+			assert.truthy(lazy_service:set_node_config("test", true, { persist_items = false }));
+			assert.same({ "test" }, cleared);
+		end);
 	end);
 
 	describe("node config checking", function ()
@@ -615,4 +664,61 @@ describe("util.pubsub", function ()
 			assert.same({ title = "Hello" }, meta);
 		end)
 	end);
+
+	describe("paging", function ()
+		local service;
+		setup(function ()
+			service = pubsub.new();
+			assert.truthy(service:create("node", true, { max_items = 10 }));
+			for i = 1, 5 do
+				assert.truthy(service:publish("node", true, tostring(i), "item " .. i));
+			end
+		end);
+
+		local function ids(ok, items)
+			assert.truthy(ok);
+			local ret = {};
+			for i, id in ipairs(items) do
+				ret[i] = id;
+			end
+			return ret;
+		end
+
+		it("returns the newest items first", function ()
+			assert.same({ "5", "4" }, ids(service:get_items("node", true, nil, { max = 2 })));
+		end);
+
+		it("continues after an item", function ()
+			assert.same({ "3", "2" }, ids(service:get_items("node", true, nil, { max = 2, after = "4" })));
+			assert.same({ "1" }, ids(service:get_items("node", true, nil, { max = 2, after = "2" })));
+		end);
+
+		it("returns the page before an item", function ()
+			assert.same({ "5", "4" }, ids(service:get_items("node", true, nil, { max = 2, before = "3" })));
+		end);
+
+		it("returns the last page", function ()
+			assert.same({ "2", "1" }, ids(service:get_items("node", true, nil, { max = 2, before = true })));
+		end);
+	end);
+
+	describe("events", function ()
+		it("are fired when node configuration and affiliations change", function ()
+			local service = pubsub.new();
+			local fired = {};
+			service.events.add_handler("node-config-changed", function (event)
+				table.insert(fired, { "config", event.node, event.config.max_items });
+			end);
+			service.events.add_handler("affiliation-changed", function (event)
+				table.insert(fired, { "affiliation", event.node, event.jid, event.affiliation });
+			end);
+			assert.truthy(service:create("node", true));
+			assert.truthy(service:set_node_config("node", true, { max_items = 5 }));
+			assert.truthy(service:set_affiliation("node", true, "someone", "outcast"));
+			assert.same({
+				{ "config", "node", 5 };
+				{ "affiliation", "node", "someone", "outcast" };
+			}, fired);
+		end);
+	end);
 end);
@@ -56,6 +56,29 @@ describe("util.smqueue", function()
 		end)
 	end)
 
+	describe("#spill", function ()
+		it("takes items out and puts them back", function ()
+			local q = smqueue.new(10);
+			for i = 1, 5 do q:push(i); end
+			assert.same({ 1; 2; 3; 4; 5 }, q:spill());
+			assert.equal(5, q:count_unacked());
+			assert.falsy(q:resumable());
+			for i = 6, 7 do q:push(i); end
+			q:restore({ 1; 2; 3; 4; 5 });
+			assert.truthy(q:resumable());
+			assert.same({ 1; 2; 3 }, q:ack(3));
+			assert.same({ 4; 5; 6; 7 }, q:table());
+		end)
+
+		it("can be restored into a new queue", function ()
+			local q = smqueue.new(10, 12, 10);
+			q:restore({ 11; 12 });
+			assert.truthy(q:resumable());
+			assert.equal(2, q:count_unacked());
+			assert.same({ 11 }, q:ack(11));
+		end)
+	end)
+
 	describe("#table", function ()
 		it("produces a compat layer", function ()
 			local q = smqueue.new(10);
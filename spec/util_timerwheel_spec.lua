@@ -0,0 +1,82 @@
+describe("util.timerwheel", function ()
+	local timerwheel;
+	setup(function ()
+		timerwheel = require "util.timerwheel";
+	end);
+
+	local function sorted(t)
+		table.sort(t);
+		return t;
+	end
+
+	it("has a constructor", function ()
+		local wheel = timerwheel.new(1, 100);
+		assert.truthy(wheel);
+		assert.equal(0, wheel:count());
+		assert.is_nil(wheel:next_expiry());
+		assert.has_error(function () timerwheel.new(0, 100); end);
+	end);
+
+	it("expires timers, never early", function ()
+		local wheel = timerwheel.new(1, 100);
+		local a = wheel:add(105);
+		local b = wheel:add(110.5);
+		assert.equal(2, #wheel);
+		assert.is_nil(wheel:advance(104.9));
+		assert.same({ a }, wheel:advance(105));
+		assert.is_nil(wheel:advance(110.9));
+		assert.same({ b }, wheel:advance(111));
+	end);
+
+	it("supports rescheduling and removing", function ()
+		local wheel = timerwheel.new(1, 0);
+		local a = wheel:add(10);
+		local b = wheel:add(10);
+		assert.truthy(wheel:reschedule(a, 20));
+		assert.truthy(wheel:remove(b));
+		assert.falsy(wheel:remove(b));
+		assert.is_nil(wheel:advance(15));
+		assert.same({ a }, wheel:advance(20));
+	end);
+
+	it("keeps expired handles until they are removed or re-armed", function ()
+		local wheel = timerwheel.new(1, 0);
+		local a = wheel:add(1);
+		assert.same({ a }, wheel:advance(1));
+		assert.equal(1, wheel:count());
+		assert.truthy(wheel:reschedule(a, 5));
+		assert.same({ a }, wheel:advance(5));
+		assert.truthy(wheel:remove(a));
+		assert.equal(0, wheel:count());
+	end);
+
+	it("handles timeouts far in the future", function ()
+		local wheel = timerwheel.new(1, 0);
+		local ids = {};
+		for i = 1, 8 do
+			ids[i] = wheel:add(i * 100000);
+		end
+		local expired = {};
+		for t = 0, 800000, 997 do
+			for _, id in ipairs(wheel:advance(t) or {}) do
+				table.insert(expired, id);
+			end
+			local next_expiry = wheel:next_expiry();
+			if next_expiry then
+				assert.truthy(next_expiry > t);
+			end
+		end
+		for _, id in ipairs(wheel:advance(800000) or {}) do
+			table.insert(expired, id);
+		end
+		assert.same(sorted(ids), sorted(expired));
+	end);
+
+	it("reports when to check next", function ()
+		local wheel = timerwheel.new(0.5, 0);
+		wheel:add(3);
+		local next_expiry = wheel:next_expiry();
+		assert.truthy(next_expiry <= 3);
+		assert.truthy(next_expiry > 0);
+	end);
+end);
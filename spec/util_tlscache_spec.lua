@@ -0,0 +1,34 @@
+describe("util.tlscache", function ()
+	local tlscache;
+	setup(function ()
+		tlscache = require "util.tlscache";
+	end);
+
+	it("can be resized", function ()
+		tlscache.set_size(10);
+		assert.equal(10, tlscache.stats().size);
+		tlscache.set_size(0);
+		assert.equal(0, tlscache.stats().size);
+		assert.equal(0, tlscache.stats().cached);
+		assert.has_error(function () tlscache.set_size(-1); end);
+	end);
+
+	it("keeps the current and previous ticket keys", function ()
+		tlscache.clear_ticket_keys();
+		assert.equal(0, tlscache.stats().ticket_keys);
+		assert.truthy(tlscache.rotate_ticket_keys());
+		assert.equal(1, tlscache.stats().ticket_keys);
+		assert.truthy(tlscache.rotate_ticket_keys());
+		assert.truthy(tlscache.rotate_ticket_keys());
+		assert.equal(2, tlscache.stats().ticket_keys);
+	end);
+
+	it("reports kTLS support", function ()
+		assert.is_boolean(tlscache.have_ktls);
+		assert.is_number(tlscache.stats().ktls_send);
+	end);
+
+	it("only accepts LuaSec contexts", function ()
+		assert.has_error(function () tlscache.configure({}, {}); end);
+	end);
+end);
@@ -0,0 +1,61 @@
+-- Compares one-shot util.hashes functions with reusable hashers
+--
+-- lua tools/hashbench.lua [iterations] [message size]
+
+package.path = "./?.lua;" .. package.path;
+package.cpath = "./?.so;" .. package.cpath;
+
+local hashes = require "util.hashes";
+
+local iterations = tonumber(arg[1]) or 200000;
+local message = ("x"):rep(tonumber(arg[2]) or 64);
+local key = ("k"):rep(32);
+
+local messages = {};
+for i = 1, iterations do
+	messages[i] = message;
+end
+
+local function bench(name, f)
+	collectgarbage();
+	local start = os.clock();
+	f();
+	local elapsed = os.clock() - start;
+	print(("%-28s %8.3fs %10.0f/s"):format(name, elapsed, iterations / elapsed));
+end
+
+bench("sha256()", function ()
+	local sha256 = hashes.sha256;
+	for _ = 1, iterations do
+		sha256(message);
+	end
+end);
+
+bench("hasher:digest()", function ()
+	local h = hashes.new("sha256");
+	for _ = 1, iterations do
+		h:digest(message);
+	end
+end);
+
+bench("hasher:digest_many()", function ()
+	hashes.new("sha256"):digest_many(messages);
+end);
+
+bench("hmac_sha256()", function ()
+	local hmac_sha256 = hashes.hmac_sha256;
+	for _ = 1, iterations do
+		hmac_sha256(key, message);
+	end
+end);
+
+bench("keyed hasher:digest()", function ()
+	local h = hashes.new("sha256", key);
+	for _ = 1, iterations do
+		h:digest(message);
+	end
+end);
+
+bench("keyed hasher:digest_many()", function ()
+	hashes.new("sha256", key):digest_many(messages);
+end);
@@ -38,9 +38,13 @@ local function usage()
 	print("Usage: " .. arg[0] .. " [OPTIONS] FROM_STORE TO_STORE");
 	print("  --config FILE         Specify config file")
 	print("  --keep-going          Keep going in case of errors");
+	print("  --parallel N          Migrate N users at a time, overlapping their file I/O (default 1)");
+	print("  --chunk-size N        Copy archives N items at a time (default 1000)");
+	print("  --checkpoint FILE     Record progress in FILE, skipping anything it lists");
 	print("  -v, --verbose         Increase log-level");
 	print("");
 	print("If no stores are specified, 'input' and 'output' are used.");
+	print("--parallel only helps with stores kept in files, SQL queries still block.");
 end
 
 if not pcall(require, "prosody.loader") then
@@ -51,7 +55,7 @@ local startup = require "prosody.util.startup";
 do
 	startup.parse_args({
 		short_params = { v = "verbose", h = "help", ["?"] = "help" };
-		value_params = { config = true };
+		value_params = { config = true; parallel = true; ["chunk-size"] = true; checkpoint = true };
 	});
 	startup.init_global_state();
 	prosody.process_type = "migrator";
@@ -88,6 +92,8 @@ local envloadfile = require "prosody.util.envload".envloadfile;
 local config_file = options.config or default_config;
 local from_store = arg[1] or "input";
 local to_store = arg[2] or "output";
+local parallel = tonumber(options.parallel or 1);
+local chunk_size = tonumber(options["chunk-size"] or 1000);
 
 config = {};
 local config_env = setmetatable({}, { __index = function(t, k) return function(tbl) config[k] = tbl; end; end });
@@ -114,6 +120,14 @@ if not config[to_store] then
 	have_err = true;
 	print("Error: Output store '"..to_store.."' not found in the config file.");
 end
+if not parallel or parallel < 1 then
+	have_err = true;
+	print("Error: --parallel must be a positive number.");
+end
+if not chunk_size or chunk_size < 1 then
+	have_err = true;
+	print("Error: --chunk-size must be a positive number.");
+end
 
 for store, conf in pairs(config) do -- COMPAT
 	if conf.type == "prosody_files" then
@@ -138,6 +152,8 @@ end
 
 local async = require "prosody.util.async";
 local server = require "prosody.net.server";
+local yieldable_xpcall = require "prosody.util.xpcall".xpcall;
+local time_now = require "prosody.util.time".now;
 local watchers = {
 	error = function (_, err)
 		error(err);
@@ -147,6 +163,61 @@ local watchers = {
 	end;
 };
 
+-- Parallel workers only overlap while waiting for file I/O done by threads
+local io_pool;
+if parallel > 1 then
+	local have_fileio, fileio = pcall(require, "prosody.util.fileio");
+	local err = fileio;
+	if have_fileio then
+		io_pool, err = fileio.new(parallel, server.watchfd);
+	end
+	if io_pool then
+		require "prosody.util.datamanager".set_async_io(io_pool);
+	else
+		log("warn", "Asynchronous file I/O is unavailable, users will be migrated one at a time: %s", err);
+	end
+end
+
+-- Each line of the checkpoint file records a host store or user already migrated
+local checkpoint_file, completed = nil, {};
+if options.checkpoint then
+	local f = io.open(options.checkpoint);
+	if f then
+		for line in f:lines() do
+			completed[line] = true;
+		end
+		f:close();
+	end
+	local err;
+	checkpoint_file, err = io.open(options.checkpoint, "a");
+	if not checkpoint_file then
+		print("Error: Unable to open checkpoint file: "..err);
+		os.exit(1);
+	end
+	checkpoint_file:setvbuf("line");
+end
+
+local function checkpoint_key(host, store, typ, user)
+	return ("%s\t%s\t%s\t%s"):format(host, store, typ, user or "");
+end
+
+local function mark_done(key)
+	if checkpoint_file then
+		checkpoint_file:write(key, "\n");
+	end
+end
+
+-- user_stores counts each user once per store migrated
+local progress = { user_stores = 0; items = 0; started = time_now(); reported = time_now() };
+
+local function report_progress(final)
+	local now = time_now();
+	if not final and now - progress.reported < 5 then return end
+	progress.reported = now;
+	local elapsed = math.max(now - progress.started, 0.001);
+	io.stderr:write(("%d user stores, %d items (%.0f items/s)\n"):format(progress.user_stores, progress.items, progress.items / elapsed));
+end
+
 local cm = require "prosody.core.configmanager";
 local hm = require "prosody.core.hostmanager";
 local sm = require "prosody.core.storagemanager";
@@ -185,12 +256,28 @@ local migrate_once = {
 		local data, err = origin:get(user);
 		assert(not err, err);
 		assert(destination:set(user, data));
+		if data ~= nil then
+			progress.items = progress.items + 1;
+		end
 	end;
 	archive = function(origin, destination, user)
-		local iter, err = origin:find(user);
-		assert(iter, err);
-		for id, item, when, with in iter do
-			assert(destination:append(user, id, item, when, with));
+		-- Stores that support queries are read a chunk at a time, so that
+		-- large archives are never held in memory all at once
+		local query = origin.caps and { limit = chunk_size } or nil;
+		repeat
+			local iter, err = origin:find(user, query);
+			assert(iter, err);
+			local count, last_id = 0, nil;
+			for id, item, when, with in iter do
+				assert(destination:append(user, id, item, when, with));
+				count, last_id = count + 1, id;
+			end
+			progress.items = progress.items + count;
+			report_progress();
+			if query then query.after = last_id; end
+		until not query or count < chunk_size
+		if destination.flush then
+			assert(destination:flush(user));
 		end
 	end;
 }
@@ -225,6 +312,14 @@ if options["keep-going"] then
 	end
 end
 
+-- Lets several worker threads take users from one iterator
+local function shared_iterator(f, s, var)
+	return function ()
+		var = f(s, var);
+		return var;
+	end;
+end
+
 local migration_runner = async.runner(function (job)
 	for host, stores in pairs(job.input.hosts) do
 		prosody.hosts[host] = startup.make_host(host);
@@ -249,18 +344,59 @@ local migration_runner = async.runner(function (job)
 			local origin = assert(input_driver:open(store, typ));
 			local destination = assert(output_driver:open(store, typ));
 
-			migrate(origin, destination, nil, prefix, input_driver, output_driver); -- host data
+			local host_key = checkpoint_key(host, store, typ);
+			if not completed[host_key] then
+				migrate(origin, destination, nil, prefix, input_driver, output_driver); -- host data
+				mark_done(host_key);
+			end
 
-			for user in users(origin, host) do
-				log("info", "Migrating user %s@%s store %s (%s)", user, host, store, typ);
-				migrate(origin, destination, user, prefix, input_driver, output_driver);
+			local next_user = shared_iterator(users(origin, host));
+			local wait, done = async.waiter(parallel);
+			local failure;
+			local function migrate_users()
+				for user in next_user do
+					local user_key = checkpoint_key(host, store, typ, user);
+					if not completed[user_key] then
+						log("info", "Migrating user %s@%s store %s (%s)", user, host, store, typ);
+						migrate(origin, destination, user, prefix, input_driver, output_driver);
+						mark_done(user_key);
+						progress.user_stores = progress.user_stores + 1;
+						report_progress();
+					end
+				end
+			end
+			for _ = 1, parallel do
+				async.runner(function ()
+					-- Always let the main runner continue, and raise errors there
+					local ok, err = yieldable_xpcall(migrate_users, debug.traceback);
+					if not ok then
+						failure = failure or err;
+					end
+					done();
+				end):run(true);
+			end
+			wait();
+			if failure then
+				error(failure, 0);
 			end
 		end
 	end
+	report_progress(true);
+	-- Stop the event loop if we had to wait for any I/O
+	server.setquitting(true);
 end, watchers);
 
 io.stderr:write("Migrating...\n");
 
 migration_runner:run({ input = config[from_store], output = config[to_store] });
 
+if checkpoint_file then
+	checkpoint_file:close();
+end
+
+if io_pool then
+	require "prosody.util.datamanager".set_async_io(nil);
+	io_pool:close();
+end
+
 io.stderr:write("Done!\n");
@@ -0,0 +1,861 @@
+/* Prosody IM
+-- Copyright (C) 2026 Prosody contributors
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+*/
+
+/*
+* aio.c
+* Thread pool for blocking file operations
+*
+* Jobs are submitted from the main thread and executed by a small pool of
+* worker threads. Besides file operations, this includes PBKDF2 key
+* derivation, which is CPU bound and would otherwise stall the event loop.
+* Completion is signalled by writing to a pipe, the read end of which can be
+* watched by net.server, after which results are collected with :completed()
+*
+* Threads do not survive fork(), so pools must be created after daemonizing
+*/
+
+#if defined(__linux__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#else
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
+
+#if ! defined(__FreeBSD__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+#define POOL_MT "util.aio<pool>"
+#define MAX_THREADS 64
+#define READ_CHUNK 0x4000
+
+enum aio_op {
+	AIO_READ,
+	AIO_STORE,
+	AIO_FSYNC,
+	AIO_RENAME,
+	AIO_REMOVE,
+	AIO_PBKDF2
+};
+
+static const char *const op_names[] = {
+	"read",
+	"store",
+	"fsync",
+	"rename",
+	"remove",
+	"pbkdf2",
+	NULL
+};
+
+typedef struct aio_job {
+	struct aio_job *next;
+	lua_Integer id;
+	enum aio_op op;
+	char *path;
+	char *path2; /* rename target, or scratch file for AIO_STORE */
+	char *data; /* data to write, data read, or password and then derived key */
+	size_t len;
+	char *salt;
+	size_t salt_len;
+	const EVP_MD *md;
+	int iterations;
+	int sync; /* fsync() before completing a store */
+	int err; /* errno, 0 on success */
+} aio_job;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	aio_job *pending_head, *pending_tail;
+	aio_job *done_head, *done_tail;
+	size_t pending, running;
+	lua_Integer last_id;
+	int notify_r, notify_w;
+	int closing;
+	int nthreads;
+	pthread_t threads[MAX_THREADS];
+	aio_job *active[MAX_THREADS]; /* jobs being run, for ordering by path */
+} aio_pool;
+
+static void job_free(aio_job *job) {
+	free(job->path);
+	free(job->path2);
+
+	if(job->op == AIO_PBKDF2) {
+		OPENSSL_clear_free(job->data, job->len);
+	} else {
+		free(job->data);
+	}
+
+	free(job->salt);
+	free(job);
+}
+
+/* Worker side */
+
+static int write_all(int fd, const char *data, size_t len) {
+	while(len > 0) {
+		ssize_t wrote = write(fd, data, len);
+
+		if(wrote < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return errno;
+		}
+
+		data += wrote;
+		len -= (size_t)wrote;
+	}
+
+	return 0;
+}
+
+static int do_read(aio_job *job) {
+	struct stat st;
+	size_t alloc, len = 0;
+	char *buf;
+	int err = 0;
+	int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+
+	if(fd < 0) {
+		return errno;
+	}
+
+	/* Size hint, the file may still change under us */
+	alloc = (fstat(fd, &st) == 0 && st.st_size > 0) ? (size_t)st.st_size + 1 : READ_CHUNK;
+	buf = malloc(alloc);
+
+	if(buf == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	for(;;) {
+		ssize_t got;
+
+		if(len == alloc) {
+			char *grown = realloc(buf, alloc * 2);
+
+			if(grown == NULL) {
+				err = ENOMEM;
+				break;
+			}
+
+			buf = grown;
+			alloc *= 2;
+		}
+
+		got = read(fd, buf + len, alloc - len);
+
+		if(got < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			err = errno;
+			break;
+		} else if(got == 0) {
+			break;
+		}
+
+		len += (size_t)got;
+	}
+
+	close(fd);
+
+	if(err) {
+		free(buf);
+		return err;
+	}
+
+	job->data = buf;
+	job->len = len;
+	return 0;
+}
+
+/* Equivalent of datamanager's atomic_store(): write to a scratch file,
+ * optionally flush it to disk, then rename it over the target.
+ *
+ * The scratch file gets a name of its own so that other processes storing
+ * the same file can't clobber it. Like mkstemp(), but leaving the mode to
+ * the umask as for any other data file. */
+static int do_store(aio_job *job) {
+	int err;
+	int fd = -1;
+	size_t len = strlen(job->path) + 48;
+
+	job->path2 = malloc(len);
+
+	if(job->path2 == NULL) {
+		return ENOMEM;
+	}
+
+	for(unsigned attempt = 0; fd < 0; attempt++) {
+		snprintf(job->path2, len, "%s~%lx.%lx.%x", job->path,
+		         (unsigned long)getpid(), (unsigned long)job->id, attempt);
+		fd = open(job->path2, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+		if(fd < 0 && (errno != EEXIST || attempt == 16)) {
+			return errno;
+		}
+	}
+
+	err = write_all(fd, job->data, job->len);
+
+	if(err == 0 && job->sync && fsync(fd) != 0) {
+		err = errno;
+	}
+
+	if(close(fd) != 0 && err == 0) {
+		err = errno;
+	}
+
+	if(err == 0 && rename(job->path2, job->path) != 0) {
+		err = errno;
+	}
+
+	if(err != 0) {
+		unlink(job->path2);
+	}
+
+	return err;
+}
+
+static int do_fsync(aio_job *job) {
+	int err = 0;
+	int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+
+	if(fd < 0) {
+		return errno;
+	}
+
+	if(fsync(fd) != 0) {
+		err = errno;
+	}
+
+	close(fd);
+	return err;
+}
+
+/* Replaces the password with the derived key, which is as long as the
+ * digest, as for SCRAM's SaltedPassword */
+static int do_pbkdf2(aio_job *job) {
+	size_t key_len = (size_t)EVP_MD_size(job->md);
+	char *key = malloc(key_len);
+
+	if(key == NULL) {
+		return ENOMEM;
+	}
+
+	if(PKCS5_PBKDF2_HMAC(job->data, (int)job->len, (const unsigned char *)job->salt, (int)job->salt_len,
+	                     job->iterations, job->md, (int)key_len, (unsigned char *)key) != 1) {
+		OPENSSL_clear_free(key, key_len);
+		return EINVAL;
+	}
+
+	OPENSSL_clear_free(job->data, job->len);
+	job->data = key;
+	job->len = key_len;
+	return 0;
+}
+
+static void run_job(aio_job *job) {
+	switch(job->op) {
+		case AIO_READ:
+			job->err = do_read(job);
+			break;
+
+		case AIO_STORE:
+			job->err = do_store(job);
+			break;
+
+		case AIO_FSYNC:
+			job->err = do_fsync(job);
+			break;
+
+		case AIO_RENAME:
+			job->err = rename(job->path, job->path2) == 0 ? 0 : errno;
+			break;
+
+		case AIO_REMOVE:
+			job->err = unlink(job->path) == 0 ? 0 : errno;
+			break;
+
+		case AIO_PBKDF2:
+			job->err = do_pbkdf2(job);
+			break;
+	}
+}
+
+/* Whether two jobs touch the same file in a way where their order matters */
+static int jobs_conflict(const aio_job *a, const aio_job *b) {
+	if(a->op == AIO_PBKDF2 || b->op == AIO_PBKDF2 || (a->op == AIO_READ && b->op == AIO_READ)) {
+		return 0;
+	}
+
+	return strcmp(a->path, b->path) == 0
+	       || (a->op == AIO_RENAME && strcmp(a->path2, b->path) == 0)
+	       || (b->op == AIO_RENAME && strcmp(a->path, b->path2) == 0)
+	       || (a->op == AIO_RENAME && b->op == AIO_RENAME && strcmp(a->path2, b->path2) == 0);
+}
+
+/* Takes the first pending job that doesn't have to wait for a running job,
+ * or one queued before it, on the same file. Called with the lock held. */
+static aio_job *take_job(aio_pool *pool) {
+	aio_job *prev = NULL;
+
+	for(aio_job *job = pool->pending_head; job != NULL; prev = job, job = job->next) {
+		int blocked = 0;
+
+		for(int i = 0; i < MAX_THREADS && !blocked; i++) {
+			blocked = pool->active[i] != NULL && jobs_conflict(job, pool->active[i]);
+		}
+
+		for(aio_job *earlier = pool->pending_head; earlier != job && !blocked; earlier = earlier->next) {
+			blocked = jobs_conflict(job, earlier);
+		}
+
+		if(blocked) {
+			continue;
+		}
+
+		if(prev) {
+			prev->next = job->next;
+		} else {
+			pool->pending_head = job->next;
+		}
+
+		if(pool->pending_tail == job) {
+			pool->pending_tail = prev;
+		}
+
+		job->next = NULL;
+		return job;
+	}
+
+	return NULL;
+}
+
+static void *worker(void *arg) {
+	aio_pool *pool = arg;
+	aio_job *job;
+	int slot;
+	ssize_t ignored;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for(;;) {
+		while((job = take_job(pool)) == NULL && !(pool->closing && pool->pending_head == NULL)) {
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+		}
+
+		if(job == NULL) {
+			/* Closing and nothing left to do */
+			break;
+		}
+
+		for(slot = 0; pool->active[slot] != NULL; slot++);
+
+		pool->active[slot] = job;
+		pool->pending--;
+		pool->running++;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->active[slot] = NULL;
+		pool->running--;
+
+		if(pool->pending_head) {
+			/* Jobs waiting for this one may be runnable now */
+			pthread_cond_broadcast(&pool->wakeup);
+		}
+
+		if(pool->done_tail) {
+			pool->done_tail->next = job;
+		} else {
+			pool->done_head = job;
+		}
+
+		pool->done_tail = job;
+
+		/* The pipe is non-blocking, a full pipe already means there is
+		 * a wakeup pending so a failed write can be ignored */
+		ignored = write(pool->notify_w, "", 1);
+		(void)ignored;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Lua side */
+
+static aio_pool *check_pool(lua_State *L, int idx) {
+	aio_pool *pool = luaL_checkudata(L, idx, POOL_MT);
+
+	if(pool->nthreads == 0) {
+		luaL_error(L, "attempt to use a closed aio pool");
+	}
+
+	return pool;
+}
+
+static char *copy_string(lua_State *L, int idx, size_t *len) {
+	size_t l;
+	const char *s = luaL_checklstring(L, idx, &l);
+	char *copy = malloc(l + 1);
+
+	if(copy == NULL) {
+		return NULL;
+	}
+
+	memcpy(copy, s, l + 1);
+
+	if(len) {
+		*len = l;
+	}
+
+	return copy;
+}
+
+static int submit(lua_State *L, aio_pool *pool, aio_job *job) {
+	pthread_mutex_lock(&pool->lock);
+	job->id = ++pool->last_id;
+
+	if(pool->pending_tail) {
+		pool->pending_tail->next = job;
+	} else {
+		pool->pending_head = job;
+	}
+
+	pool->pending_tail = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+
+	lua_pushinteger(L, job->id);
+	return 1;
+}
+
+static aio_job *new_job(lua_State *L, enum aio_op op) {
+	aio_job *job;
+
+	/* Check arguments before allocating anything that could leak */
+	luaL_checkstring(L, 2);
+	job = calloc(1, sizeof(aio_job));
+
+	if(job == NULL) {
+		return NULL;
+	}
+
+	job->op = op;
+	job->path = copy_string(L, 2, NULL);
+
+	if(job->path == NULL) {
+		job_free(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+static int job_oom(lua_State *L) {
+	luaL_pushfail(L);
+	lua_pushstring(L, strerror(ENOMEM));
+	lua_pushinteger(L, ENOMEM);
+	return 3;
+}
+
+/* pool:read(path) -> job id */
+static int Lread(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	aio_job *job = new_job(L, AIO_READ);
+
+	if(job == NULL) {
+		return job_oom(L);
+	}
+
+	return submit(L, pool, job);
+}
+
+/* pool:store(path, data, sync) -> job id */
+static int Lstore(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	aio_job *job;
+
+	luaL_checkstring(L, 3);
+	job = new_job(L, AIO_STORE);
+
+	if(job == NULL) {
+		return job_oom(L);
+	}
+
+	job->sync = lua_isnoneornil(L, 4) ? 1 : lua_toboolean(L, 4);
+	job->data = copy_string(L, 3, &job->len);
+
+	if(job->data == NULL) {
+		job_free(job);
+		return job_oom(L);
+	}
+
+	return submit(L, pool, job);
+}
+
+/* pool:fsync(path) -> job id */
+static int Lfsync(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	aio_job *job = new_job(L, AIO_FSYNC);
+
+	if(job == NULL) {
+		return job_oom(L);
+	}
+
+	return submit(L, pool, job);
+}
+
+/* pool:rename(from, to) -> job id */
+static int Lrename(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	aio_job *job;
+
+	luaL_checkstring(L, 3);
+	job = new_job(L, AIO_RENAME);
+
+	if(job == NULL) {
+		return job_oom(L);
+	}
+
+	job->path2 = copy_string(L, 3, NULL);
+
+	if(job->path2 == NULL) {
+		job_free(job);
+		return job_oom(L);
+	}
+
+	return submit(L, pool, job);
+}
+
+/* pool:remove(path) -> job id */
+static int Lremove(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	aio_job *job = new_job(L, AIO_REMOVE);
+
+	if(job == NULL) {
+		return job_oom(L);
+	}
+
+	return submit(L, pool, job);
+}
+
+static const char *const pbkdf2_digests[] = { "sha1", "sha256", "sha512", NULL };
+
+/* pool:pbkdf2(digest, password, salt, iterations) -> job id */
+static int Lpbkdf2(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	int digest = luaL_checkoption(L, 2, NULL, pbkdf2_digests);
+	lua_Integer iterations = luaL_checkinteger(L, 5);
+	aio_job *job;
+
+	luaL_checkstring(L, 3);
+	luaL_checkstring(L, 4);
+	luaL_argcheck(L, iterations > 0 && iterations <= 0x7fffffff, 5, "invalid number of iterations");
+
+	job = calloc(1, sizeof(aio_job));
+
+	if(job == NULL) {
+		return job_oom(L);
+	}
+
+	job->op = AIO_PBKDF2;
+	job->iterations = (int)iterations;
+	job->md = digest == 0 ? EVP_sha1() : digest == 1 ? EVP_sha256() : EVP_sha512();
+	job->data = copy_string(L, 3, &job->len);
+	job->salt = copy_string(L, 4, &job->salt_len);
+
+	if(job->data == NULL || job->salt == NULL) {
+		job_free(job);
+		return job_oom(L);
+	}
+
+	return submit(L, pool, job);
+}
+
+/* Iterator returning id, ok, data|err, errno, op for each finished job */
+static int Lnext_completed(lua_State *L) {
+	aio_pool *pool = luaL_checkudata(L, 1, POOL_MT);
+	aio_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	job = pool->done_head;
+
+	if(job) {
+		pool->done_head = job->next;
+
+		if(pool->done_head == NULL) {
+			pool->done_tail = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if(job == NULL) {
+		return 0;
+	}
+
+	lua_pushinteger(L, job->id);
+
+	if(job->err == 0) {
+		lua_pushboolean(L, 1);
+
+		if(job->op == AIO_READ || job->op == AIO_PBKDF2) {
+			lua_pushlstring(L, job->data, job->len);
+		} else {
+			lua_pushnil(L);
+		}
+
+		lua_pushnil(L);
+	} else {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(job->err));
+		lua_pushinteger(L, job->err);
+	}
+
+	lua_pushstring(L, op_names[job->op]);
+	job_free(job);
+	return 5;
+}
+
+/* for id, ok, ret, errno, op in pool:completed() do ... end */
+static int Lcompleted(lua_State *L) {
+	aio_pool *pool = luaL_checkudata(L, 1, POOL_MT);
+	char drain[64];
+
+	/* Clear pending wakeups, results are tracked by the done list */
+	if(pool->notify_r != -1) {
+		while(read(pool->notify_r, drain, sizeof(drain)) > 0);
+	}
+
+	lua_pushcfunction(L, Lnext_completed);
+	lua_pushvalue(L, 1);
+	return 2;
+}
+
+static int Lgetfd(lua_State *L) {
+	aio_pool *pool = check_pool(L, 1);
+	lua_pushinteger(L, pool->notify_r);
+	return 1;
+}
+
+static int Lstats(lua_State *L) {
+	aio_pool *pool = luaL_checkudata(L, 1, POOL_MT);
+	size_t pending, running;
+
+	pthread_mutex_lock(&pool->lock);
+	pending = pool->pending;
+	running = pool->running;
+	pthread_mutex_unlock(&pool->lock);
+
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, (lua_Integer)pending);
+	lua_setfield(L, -2, "pending");
+	lua_pushinteger(L, (lua_Integer)running);
+	lua_setfield(L, -2, "running");
+	lua_pushinteger(L, pool->nthreads);
+	lua_setfield(L, -2, "threads");
+	return 1;
+}
+
+/* Waits for queued jobs to finish and stops the worker threads.
+ * Completed jobs can still be collected afterwards. */
+static int Lclose(lua_State *L) {
+	aio_pool *pool = luaL_checkudata(L, 1, POOL_MT);
+
+	if(pool->nthreads == 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closing = 1;
+	pthread_cond_broadcast(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(int i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pool->nthreads = 0;
+	close(pool->notify_w);
+	pool->notify_w = -1;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lgc(lua_State *L) {
+	aio_pool *pool = luaL_checkudata(L, 1, POOL_MT);
+	aio_job *job;
+
+	Lclose(L);
+
+	if(pool->notify_w != -1) {
+		close(pool->notify_w);
+		pool->notify_w = -1;
+	}
+
+	while((job = pool->done_head) != NULL) {
+		pool->done_head = job->next;
+		job_free(job);
+	}
+
+	if(pool->notify_r != -1) {
+		close(pool->notify_r);
+		pool->notify_r = -1;
+	}
+
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->lock);
+	return 0;
+}
+
+static int Ltostring(lua_State *L) {
+	aio_pool *pool = luaL_checkudata(L, 1, POOL_MT);
+	lua_pushfstring(L, "aio pool (%d threads): %p", pool->nthreads, pool);
+	return 1;
+}
+
+/* aio.new(nthreads) -> pool */
+static int Lnew(lua_State *L) {
+	int nthreads = (int)luaL_optinteger(L, 1, 2);
+	int fds[2];
+	aio_pool *pool;
+
+	luaL_argcheck(L, nthreads > 0 && nthreads <= MAX_THREADS, 1, "invalid number of threads");
+
+	pool = lua_newuserdata(L, sizeof(aio_pool));
+	memset(pool, 0, sizeof(aio_pool));
+	pool->notify_r = pool->notify_w = -1;
+
+	if(pipe(fds) != 0) {
+		int err = errno;
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	for(int i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	pool->notify_r = fds[0];
+	pool->notify_w = fds[1];
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+	luaL_setmetatable(L, POOL_MT);
+
+	for(int i = 0; i < nthreads; i++) {
+		int err = pthread_create(&pool->threads[i], NULL, worker, pool);
+
+		if(err != 0) {
+			if(i == 0) {
+				/* __gc takes care of the rest */
+				luaL_pushfail(L);
+				lua_pushstring(L, strerror(err));
+				lua_pushinteger(L, err);
+				return 3;
+			}
+
+			break;
+		}
+
+		pool->nthreads = i + 1;
+	}
+
+	return 1;
+}
+
+int luaopen_prosody_util_aio(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, POOL_MT)) {
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, Ltostring);
+		lua_setfield(L, -2, "__tostring");
+
+		lua_createtable(L, 0, 10); /* __index */
+		{
+			lua_pushcfunction(L, Lread);
+			lua_setfield(L, -2, "read");
+			lua_pushcfunction(L, Lstore);
+			lua_setfield(L, -2, "store");
+			lua_pushcfunction(L, Lfsync);
+			lua_setfield(L, -2, "fsync");
+			lua_pushcfunction(L, Lrename);
+			lua_setfield(L, -2, "rename");
+			lua_pushcfunction(L, Lremove);
+			lua_setfield(L, -2, "remove");
+			lua_pushcfunction(L, Lpbkdf2);
+			lua_setfield(L, -2, "pbkdf2");
+			lua_pushcfunction(L, Lcompleted);
+			lua_setfield(L, -2, "completed");
+			lua_pushcfunction(L, Lgetfd);
+			lua_setfield(L, -2, "getfd");
+			lua_pushcfunction(L, Lstats);
+			lua_setfield(L, -2, "stats");
+			lua_pushcfunction(L, Lclose);
+			lua_setfield(L, -2, "close");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 2);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	lua_pushinteger(L, ENOENT);
+	lua_setfield(L, -2, "ENOENT");
+	return 1;
+}
+
+int luaopen_util_aio(lua_State *L) {
+	return luaopen_prosody_util_aio(L);
+}
@@ -10,6 +10,10 @@
 /*
 * hashes.c
 * Lua library for sha1, sha256 and md5 hashes
+*
+* Besides the one-shot functions, hashes.new() returns a reusable hasher,
+* optionally keyed for HMAC, which avoids setting up a new context (and
+* hashing the HMAC key) for every message.
 */
 
 #include <string.h>
@@ -39,6 +43,8 @@ typedef unsigned __int32 uint32_t;
 */
 #define MAX_HKDF_OUTPUT 256
 
+#define HASHER_MT "util.hashes<hasher>"
+
 static const char *hex_tab = "0123456789abcdef";
 static void toHex(const unsigned char *in, int length, unsigned char *out) {
 	int i;
@@ -283,6 +289,281 @@ static int Lhash_equals(lua_State *L) {
 	return 1;
 }
 
+static const char *const digest_names[] = {
+	"sha1", "sha224", "sha256", "sha384", "sha512", "md5",
+	"sha3_256", "sha3_512", "blake2s256", "blake2b512", NULL
+};
+
+static const EVP_MD *get_digest(int i) {
+	switch(i) {
+		case 0: return EVP_sha1();
+		case 1: return EVP_sha224();
+		case 2: return EVP_sha256();
+		case 3: return EVP_sha384();
+		case 4: return EVP_sha512();
+		case 5: return EVP_md5();
+		case 6: return EVP_sha3_256();
+		case 7: return EVP_sha3_512();
+		case 8: return EVP_blake2s256();
+		default: return EVP_blake2b512();
+	}
+}
+
+typedef struct {
+	EVP_MD_CTX *ctx; /* running state */
+	/* For HMAC, the states after absorbing the padded key, copied on reset
+	 * instead of hashing the key again for every message */
+	EVP_MD_CTX *inner;
+	EVP_MD_CTX *outer;
+	const EVP_MD *md;
+} hasher;
+
+static hasher *check_hasher(lua_State *L) {
+	hasher *h = luaL_checkudata(L, 1, HASHER_MT);
+
+	if(h->ctx == NULL) {
+		luaL_error(L, "attempt to use a freed hasher");
+	}
+
+	return h;
+}
+
+static int hasher_reset(hasher *h) {
+	if(h->inner) {
+		return EVP_MD_CTX_copy_ex(h->ctx, h->inner);
+	}
+
+	return EVP_DigestInit_ex(h->ctx, h->md, NULL);
+}
+
+/* Finishes the current message and resets for the next one */
+static int hasher_final(hasher *h, unsigned char *out, unsigned int *out_len) {
+	if(!EVP_DigestFinal_ex(h->ctx, out, out_len)) {
+		return 0;
+	}
+
+	if(h->outer) {
+		if(!EVP_MD_CTX_copy_ex(h->ctx, h->outer)
+		        || !EVP_DigestUpdate(h->ctx, out, *out_len)
+		        || !EVP_DigestFinal_ex(h->ctx, out, out_len)) {
+			return 0;
+		}
+	}
+
+	return hasher_reset(h);
+}
+
+static void push_digest(lua_State *L, const unsigned char *hash, unsigned int size, int hex_out) {
+	unsigned char result[EVP_MAX_MD_SIZE * 2];
+
+	if(hex_out) {
+		toHex(hash, size, result);
+		lua_pushlstring(L, (char *)result, size * 2);
+	} else {
+		lua_pushlstring(L, (char *)hash, size);
+	}
+}
+
+static int hasher_error(lua_State *L) {
+	return luaL_error(L, "%s", ERR_error_string(ERR_get_error(), NULL));
+}
+
+/* Sets up the HMAC pads as per RFC 2104 */
+static int hasher_set_key(hasher *h, const unsigned char *key, size_t key_len) {
+	unsigned char pad[EVP_MAX_MD_SIZE > 144 ? EVP_MAX_MD_SIZE : 144];
+	unsigned char key_hash[EVP_MAX_MD_SIZE];
+	int block_size = EVP_MD_block_size(h->md);
+	int i;
+
+	if(block_size <= 0 || (size_t)block_size > sizeof(pad)) {
+		return 0;
+	}
+
+	if(key_len > (size_t)block_size) {
+		unsigned int key_hash_len;
+
+		if(!EVP_DigestInit_ex(h->ctx, h->md, NULL)
+		        || !EVP_DigestUpdate(h->ctx, key, key_len)
+		        || !EVP_DigestFinal_ex(h->ctx, key_hash, &key_hash_len)) {
+			return 0;
+		}
+
+		key = key_hash;
+		key_len = key_hash_len;
+	}
+
+	h->inner = EVP_MD_CTX_new();
+	h->outer = EVP_MD_CTX_new();
+
+	if(h->inner == NULL || h->outer == NULL) {
+		return 0;
+	}
+
+	for(i = 0; i < block_size; i++) {
+		pad[i] = ((size_t)i < key_len ? key[i] : 0) ^ 0x36;
+	}
+
+	if(!EVP_DigestInit_ex(h->inner, h->md, NULL) || !EVP_DigestUpdate(h->inner, pad, block_size)) {
+		return 0;
+	}
+
+	for(i = 0; i < block_size; i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+
+	if(!EVP_DigestInit_ex(h->outer, h->md, NULL) || !EVP_DigestUpdate(h->outer, pad, block_size)) {
+		return 0;
+	}
+
+	OPENSSL_cleanse(pad, sizeof(pad));
+	OPENSSL_cleanse(key_hash, sizeof(key_hash));
+	return 1;
+}
+
+/* hasher = hashes.new(name, key) -- HMAC when a key is given */
+static int Lnew_hasher(lua_State *L) {
+	int digest = luaL_checkoption(L, 1, NULL, digest_names);
+	size_t key_len;
+	const char *key = luaL_optlstring(L, 2, NULL, &key_len);
+	hasher *h = lua_newuserdata(L, sizeof(hasher));
+
+	memset(h, 0, sizeof(hasher));
+	luaL_setmetatable(L, HASHER_MT);
+	h->md = get_digest(digest);
+	h->ctx = EVP_MD_CTX_new();
+
+	if(h->ctx == NULL) {
+		return hasher_error(L);
+	}
+
+	if(key && !hasher_set_key(h, (const unsigned char *)key, key_len)) {
+		return hasher_error(L);
+	}
+
+	if(!hasher_reset(h)) {
+		return hasher_error(L);
+	}
+
+	return 1;
+}
+
+/* hasher:update(data, ...) -> hasher */
+static int Lhasher_update(lua_State *L) {
+	hasher *h = check_hasher(L);
+	int n = lua_gettop(L);
+
+	for(int i = 2; i <= n; i++) {
+		size_t len;
+		const char *s = luaL_checklstring(L, i, &len);
+
+		if(!EVP_DigestUpdate(h->ctx, s, len)) {
+			return hasher_error(L);
+		}
+	}
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* hasher:final(hex) -> digest of everything since the last reset */
+static int Lhasher_final(lua_State *L) {
+	hasher *h = check_hasher(L);
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int size = EVP_MAX_MD_SIZE;
+
+	if(!hasher_final(h, hash, &size)) {
+		return hasher_error(L);
+	}
+
+	push_digest(L, hash, size, lua_toboolean(L, 2));
+	return 1;
+}
+
+static int Lhasher_reset(lua_State *L) {
+	hasher *h = check_hasher(L);
+
+	if(!hasher_reset(h)) {
+		return hasher_error(L);
+	}
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* hasher:digest(data, hex) -> digest of only 'data' */
+static int Lhasher_digest(lua_State *L) {
+	hasher *h = check_hasher(L);
+	size_t len;
+	const char *s = luaL_checklstring(L, 2, &len);
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int size = EVP_MAX_MD_SIZE;
+
+	if(!hasher_reset(h) || !EVP_DigestUpdate(h->ctx, s, len) || !hasher_final(h, hash, &size)) {
+		return hasher_error(L);
+	}
+
+	push_digest(L, hash, size, lua_toboolean(L, 3));
+	return 1;
+}
+
+/* hasher:digest_many({ data, ... }, hex) -> { digest, ... } */
+static int Lhasher_digest_many(lua_State *L) {
+	hasher *h = check_hasher(L);
+	int hex_out = lua_toboolean(L, 3);
+	lua_Integer i, n;
+	unsigned char hash[EVP_MAX_MD_SIZE];
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (lua_Integer)lua_rawlen(L, 2);
+	lua_createtable(L, n < 0x7fffffff ? (int)n : 0, 0);
+
+	if(!hasher_reset(h)) {
+		return hasher_error(L);
+	}
+
+	for(i = 1; i <= n; i++) {
+		unsigned int size = EVP_MAX_MD_SIZE;
+		size_t len;
+		const char *s;
+
+		lua_rawgeti(L, 2, i);
+		s = lua_tolstring(L, -1, &len);
+
+		if(s == NULL) {
+			hasher_reset(h);
+			return luaL_error(L, "item %d is not a string", (int)i);
+		}
+
+		if(!EVP_DigestUpdate(h->ctx, s, len) || !hasher_final(h, hash, &size)) {
+			return hasher_error(L);
+		}
+
+		lua_pop(L, 1);
+		push_digest(L, hash, size, hex_out);
+		lua_rawseti(L, -2, i);
+	}
+
+	return 1;
+}
+
+static int Lhasher_gc(lua_State *L) {
+	hasher *h = luaL_checkudata(L, 1, HASHER_MT);
+	EVP_MD_CTX_free(h->ctx);
+	EVP_MD_CTX_free(h->inner);
+	EVP_MD_CTX_free(h->outer);
+	h->ctx = h->inner = h->outer = NULL;
+	return 0;
+}
+
+static const luaL_Reg HasherMethods[] = {
+	{ "update",		Lhasher_update		},
+	{ "final",		Lhasher_final		},
+	{ "reset",		Lhasher_reset		},
+	{ "digest",		Lhasher_digest		},
+	{ "digest_many",	Lhasher_digest_many	},
+	{ NULL,			NULL			}
+};
+
 static const luaL_Reg Reg[] = {
 	{ "sha1",		Lsha1		},
 	{ "sha224",		Lsha224		},
@@ -310,11 +591,23 @@ static const luaL_Reg Reg[] = {
 	{ "hkdf_hmac_sha256",   Lhkdf_sha256    },
 	{ "hkdf_hmac_sha384",   Lhkdf_sha384    },
 	{ "equals",             Lhash_equals    },
+	{ "new",		Lnew_hasher	},
 	{ NULL,			NULL		}
 };
 
 LUALIB_API int luaopen_prosody_util_hashes(lua_State *L) {
 	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, HASHER_MT)) {
+		lua_pushcfunction(L, Lhasher_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_newtable(L);
+		luaL_setfuncs(L, HasherMethods, 0);
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
 	lua_newtable(L);
 	luaL_setfuncs(L, Reg, 0);
 	lua_pushliteral(L, "-3.14");
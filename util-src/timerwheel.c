@@ -0,0 +1,435 @@
+/* Prosody IM
+-- Copyright (C) 2026 Prosody contributors
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+*/
+
+/*
+* timerwheel.c
+* Hashed hierarchical timing wheel
+*
+* Timers are integer handles. Adding, rescheduling and removing them is
+* O(1). Expiry is rounded up to the resolution of the wheel, so it suits
+* coarse timeouts such as those on idle connections, not precise timers.
+*
+* Expired timers keep their handle until they are either rescheduled,
+* which re-arms them, or removed.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define DUE_SLOT (WHEEL_LEVELS * WHEEL_SIZE) /* Timers already due */
+#define MAX_DELTA (((tick_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define NONE -1
+#define SLOT_FREE -1
+#define SLOT_EXPIRED -2
+
+#define MT "util.timerwheel"
+
+typedef long long tick_t;
+
+typedef struct {
+	tick_t tick;
+	int next;
+	int prev;
+	int slot;
+} wheel_timer;
+
+typedef struct {
+	double resolution;
+	tick_t current;
+	int count;
+	int alen;
+	int free_list;
+	wheel_timer *timers;
+	int slots[DUE_SLOT + 1];
+} wheel;
+
+static tick_t time_to_tick(const wheel *w, lua_Number t) {
+	return (tick_t)ceil(t / w->resolution);
+}
+
+static void link_timer(wheel *w, int i, int slot) {
+	wheel_timer *t = &w->timers[i];
+	t->slot = slot;
+	t->prev = NONE;
+	t->next = w->slots[slot];
+
+	if(t->next != NONE) {
+		w->timers[t->next].prev = i;
+	}
+
+	w->slots[slot] = i;
+}
+
+static void unlink_timer(wheel *w, int i) {
+	wheel_timer *t = &w->timers[i];
+
+	if(t->slot == SLOT_EXPIRED) {
+		return;
+	}
+
+	if(t->prev != NONE) {
+		w->timers[t->prev].next = t->next;
+	} else {
+		w->slots[t->slot] = t->next;
+	}
+
+	if(t->next != NONE) {
+		w->timers[t->next].prev = t->prev;
+	}
+}
+
+/* Put the timer in the slot for its level, based on how far ahead it is */
+static void place_timer(wheel *w, int i) {
+	tick_t tick = w->timers[i].tick;
+	tick_t delta = tick - w->current;
+	int level;
+
+	if(delta <= 0) {
+		link_timer(w, i, DUE_SLOT);
+		return;
+	}
+
+	if(delta > MAX_DELTA) {
+		/* Parked in the outermost level, placed again when it cascades */
+		tick = w->current + MAX_DELTA;
+		delta = MAX_DELTA;
+	}
+
+	for(level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if(delta < ((tick_t)1 << (WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	link_timer(w, i, level * WHEEL_SIZE + (int)((tick >> (WHEEL_BITS * level)) & WHEEL_MASK));
+}
+
+static void free_timer(wheel *w, int i) {
+	w->timers[i].slot = SLOT_FREE;
+	w->timers[i].next = w->free_list;
+	w->free_list = i;
+	w->count--;
+}
+
+static int alloc_timer(lua_State *L, wheel *w) {
+	int i;
+
+	if(w->free_list == NONE) {
+		int alen = w->alen ? w->alen * 2 : 64;
+		wheel_timer *timers;
+
+		if(alen <= w->alen) {
+			return luaL_error(L, "too many timers");
+		}
+
+		timers = realloc(w->timers, (size_t)alen * sizeof(wheel_timer));
+
+		if(timers == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+
+		for(i = alen - 1; i >= w->alen; i--) {
+			timers[i].slot = SLOT_FREE;
+			timers[i].next = w->free_list;
+			w->free_list = i;
+		}
+
+		w->timers = timers;
+		w->alen = alen;
+	}
+
+	i = w->free_list;
+	w->free_list = w->timers[i].next;
+	w->count++;
+	return i;
+}
+
+/* Returns the index of the timer with the handle at 'arg', or NONE */
+static int check_handle(lua_State *L, const wheel *w, int arg) {
+	lua_Integer id = luaL_checkinteger(L, arg);
+
+	if(id < 1 || id > w->alen || w->timers[id - 1].slot == SLOT_FREE) {
+		return NONE;
+	}
+
+	return (int)(id - 1);
+}
+
+/* Empties a slot, adding the timers that are due to the table of expired
+ * handles (created on first use) and placing the rest again */
+static void expire_slot(lua_State *L, wheel *w, int slot, int *n) {
+	int i = w->slots[slot];
+	w->slots[slot] = NONE;
+
+	while(i != NONE) {
+		int next = w->timers[i].next;
+
+		if(w->timers[i].tick <= w->current) {
+			if(*n == 0) {
+				lua_createtable(L, 8, 0);
+			}
+
+			lua_pushinteger(L, i + 1);
+			lua_rawseti(L, -2, ++(*n));
+			w->timers[i].slot = SLOT_EXPIRED;
+		} else {
+			place_timer(w, i);
+		}
+
+		i = next;
+	}
+}
+
+/* Moves the timers of a slot in an outer level further in */
+static void cascade(wheel *w, int slot) {
+	int i = w->slots[slot];
+	w->slots[slot] = NONE;
+
+	while(i != NONE) {
+		int next = w->timers[i].next;
+		place_timer(w, i);
+		i = next;
+	}
+}
+
+static wheel *check_wheel(lua_State *L) {
+	return luaL_checkudata(L, 1, MT);
+}
+
+/*
+ * wheel = timerwheel.new(resolution, now)
+ */
+static int Lnew(lua_State *L) {
+	lua_Number resolution = luaL_checknumber(L, 1);
+	lua_Number now = luaL_checknumber(L, 2);
+	wheel *w;
+	int i;
+
+	luaL_argcheck(L, resolution > 0, 1, "resolution must be positive");
+
+	w = lua_newuserdata(L, sizeof(wheel));
+	w->resolution = resolution;
+	w->current = (tick_t)floor(now / resolution);
+	w->count = 0;
+	w->alen = 0;
+	w->free_list = NONE;
+	w->timers = NULL;
+
+	for(i = 0; i <= DUE_SLOT; i++) {
+		w->slots[i] = NONE;
+	}
+
+	luaL_setmetatable(L, MT);
+	return 1;
+}
+
+/*
+ * id = wheel:add(time)
+ */
+static int Ladd(lua_State *L) {
+	wheel *w = check_wheel(L);
+	tick_t tick = time_to_tick(w, luaL_checknumber(L, 2));
+	int i = alloc_timer(L, w);
+
+	w->timers[i].tick = tick;
+	place_timer(w, i);
+	lua_pushinteger(L, i + 1);
+	return 1;
+}
+
+/*
+ * ok = wheel:reschedule(id, time)
+ */
+static int Lreschedule(lua_State *L) {
+	wheel *w = check_wheel(L);
+	int i = check_handle(L, w, 2);
+	tick_t tick = time_to_tick(w, luaL_checknumber(L, 3));
+
+	if(i == NONE) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	unlink_timer(w, i);
+	w->timers[i].tick = tick;
+	place_timer(w, i);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * ok = wheel:remove(id)
+ */
+static int Lremove(lua_State *L) {
+	wheel *w = check_wheel(L);
+	int i = check_handle(L, w, 2);
+
+	if(i == NONE) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	unlink_timer(w, i);
+	free_timer(w, i);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * expired = wheel:advance(now)
+ * Returns an array of handles of timers that have expired, or nil if none
+ * did. Each must then be rescheduled or removed.
+ */
+static int Ladvance(lua_State *L) {
+	wheel *w = check_wheel(L);
+	tick_t target = (tick_t)floor(luaL_checknumber(L, 2) / w->resolution);
+	int n = 0;
+	int level;
+
+	expire_slot(L, w, DUE_SLOT, &n);
+
+	if(w->count == 0 && target > w->current) {
+		/* Nothing to do on the way */
+		w->current = target;
+	}
+
+	while(w->current < target) {
+		w->current++;
+
+		for(level = WHEEL_LEVELS - 1; level > 0; level--) {
+			if((w->current & (((tick_t)1 << (WHEEL_BITS * level)) - 1)) == 0) {
+				cascade(w, level * WHEEL_SIZE + (int)((w->current >> (WHEEL_BITS * level)) & WHEEL_MASK));
+			}
+		}
+
+		expire_slot(L, w, DUE_SLOT, &n);
+		expire_slot(L, w, (int)(w->current & WHEEL_MASK), &n);
+	}
+
+	if(n == 0) {
+		luaL_pushfail(L);
+	}
+
+	return 1;
+}
+
+/*
+ * time = wheel:next_expiry()
+ * Earliest time at which advance() might return something, or nil when
+ * the wheel is empty. Timers in outer levels only give the time they are
+ * moved further in, so this may be earlier than any actual expiry.
+ */
+static int Lnext_expiry(lua_State *L) {
+	wheel *w = check_wheel(L);
+	tick_t next = -1;
+	int level, i;
+
+	if(w->count == 0) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	if(w->slots[DUE_SLOT] != NONE) {
+		lua_pushnumber(L, (lua_Number)w->current * w->resolution);
+		return 1;
+	}
+
+	/* An outer level may cascade before the first timer in an inner one */
+	for(level = 0; level < WHEEL_LEVELS; level++) {
+		tick_t base = w->current >> (WHEEL_BITS * level);
+
+		for(i = 1; i <= WHEEL_SIZE; i++) {
+			int slot = level * WHEEL_SIZE + (int)((base + i) & WHEEL_MASK);
+
+			if(w->slots[slot] != NONE) {
+				tick_t tick = (base + i) << (WHEEL_BITS * level);
+
+				if(next < 0 || tick < next) {
+					next = tick;
+				}
+
+				break;
+			}
+		}
+	}
+
+	if(next < 0) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	lua_pushnumber(L, (lua_Number)next * w->resolution);
+	return 1;
+}
+
+static int Lcount(lua_State *L) {
+	wheel *w = check_wheel(L);
+	lua_pushinteger(L, w->count);
+	return 1;
+}
+
+static int Lgc(lua_State *L) {
+	wheel *w = check_wheel(L);
+	free(w->timers);
+	w->timers = NULL;
+	w->alen = 0;
+	w->count = 0;
+	w->free_list = NONE;
+	return 0;
+}
+
+int luaopen_prosody_util_timerwheel(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, MT)) {
+		lua_pushcfunction(L, Lcount);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 6); /* __index */
+		{
+			lua_pushcfunction(L, Ladd);
+			lua_setfield(L, -2, "add");
+			lua_pushcfunction(L, Lreschedule);
+			lua_setfield(L, -2, "reschedule");
+			lua_pushcfunction(L, Lremove);
+			lua_setfield(L, -2, "remove");
+			lua_pushcfunction(L, Ladvance);
+			lua_setfield(L, -2, "advance");
+			lua_pushcfunction(L, Lnext_expiry);
+			lua_setfield(L, -2, "next_expiry");
+			lua_pushcfunction(L, Lcount);
+			lua_setfield(L, -2, "count");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_timerwheel(lua_State *L) {
+	return luaopen_prosody_util_timerwheel(L);
+}
@@ -0,0 +1,526 @@
+/* Prosody IM
+-- Copyright (C) 2026 Prosody contributors
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+*/
+
+/*
+* tlscache.c
+* Server-wide TLS session cache and session ticket keys
+*
+* Sessions from every configured context go into one LRU cache, bounded by
+* a number of sessions. Session tickets are encrypted with keys shared by
+* all contexts and rotated on demand, with the previous key kept so that
+* recently issued tickets can still be used.
+*
+* Resumption only works within the same session id context, which is set
+* per context so a session is never resumed under a different identity.
+*
+* Contexts can also ask OpenSSL to hand record encryption to the kernel
+* (kTLS) after the handshake. OpenSSL quietly keeps doing it itself if the
+* kernel can't, so the counters tell whether it is actually used.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+
+#if (LUA_VERSION_NUM == 501)
+#define luaL_setfuncs(L, R, N) luaL_register(L, NULL, R)
+#endif
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+/* Metatable of LuaSec contexts, whose first field is the SSL_CTX pointer */
+#define LUASEC_CONTEXT "SSL:Context"
+
+#define TICKET_KEYS 2
+#define TICKET_NAME_LENGTH 16
+#define TICKET_KEY_LENGTH 32
+
+typedef struct cache_entry {
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned int id_len;
+	SSL_SESSION *session;
+	struct cache_entry *hash_next;
+	struct cache_entry *newer;
+	struct cache_entry *older;
+} cache_entry;
+
+typedef struct {
+	unsigned char name[TICKET_NAME_LENGTH];
+	unsigned char aes_key[TICKET_KEY_LENGTH];
+	unsigned char hmac_key[TICKET_KEY_LENGTH];
+} ticket_key;
+
+static cache_entry **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t cache_count = 0;
+static size_t cache_capacity = 0;
+static cache_entry *newest = NULL;
+static cache_entry *oldest = NULL;
+
+static ticket_key ticket_keys[TICKET_KEYS]; /* Current key first */
+static int ticket_key_count = 0;
+
+/* Completed handshakes, [client/server][full/resumed] */
+static lua_Integer handshakes[2][2];
+static lua_Integer cache_evictions = 0;
+static lua_Integer ktls_send = 0;
+static lua_Integer ktls_recv = 0;
+static int counted_index = -1;
+
+static size_t hash_id(const unsigned char *id, unsigned int len) {
+	size_t h = 2166136261u;
+	unsigned int i;
+
+	for(i = 0; i < len; i++) {
+		h = (h ^ id[i]) * 16777619u;
+	}
+
+	return h & (bucket_count - 1);
+}
+
+static cache_entry **find_entry(const unsigned char *id, unsigned int len) {
+	cache_entry **e;
+
+	if(bucket_count == 0) {
+		return NULL;
+	}
+
+	for(e = &buckets[hash_id(id, len)]; *e != NULL; e = &(*e)->hash_next) {
+		if((*e)->id_len == len && memcmp((*e)->id, id, len) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void lru_unlink(cache_entry *e) {
+	if(e->newer) {
+		e->newer->older = e->older;
+	} else {
+		newest = e->older;
+	}
+
+	if(e->older) {
+		e->older->newer = e->newer;
+	} else {
+		oldest = e->newer;
+	}
+}
+
+static void lru_push(cache_entry *e) {
+	e->newer = NULL;
+	e->older = newest;
+
+	if(newest) {
+		newest->newer = e;
+	} else {
+		oldest = e;
+	}
+
+	newest = e;
+}
+
+/* Unlinks the entry that 'e' points at and frees it with its session */
+static void drop_entry(cache_entry **e) {
+	cache_entry *entry = *e;
+	*e = entry->hash_next;
+	lru_unlink(entry);
+	SSL_SESSION_free(entry->session);
+	free(entry);
+	cache_count--;
+}
+
+static void evict_oldest(void) {
+	cache_entry **e;
+
+	while(cache_count > cache_capacity && oldest != NULL) {
+		e = find_entry(oldest->id, oldest->id_len);
+
+		if(e == NULL) {
+			break;
+		}
+
+		drop_entry(e);
+		cache_evictions++;
+	}
+}
+
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+	const unsigned char *id;
+	unsigned int len;
+	cache_entry **e, *entry;
+	(void)ssl;
+
+	if(cache_capacity == 0) {
+		return 0;
+	}
+
+	id = SSL_SESSION_get_id(session, &len);
+
+	if(len == 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+		return 0;
+	}
+
+	e = find_entry(id, len);
+
+	if(e != NULL) {
+		drop_entry(e);
+	}
+
+	entry = malloc(sizeof(cache_entry));
+
+	if(entry == NULL) {
+		return 0;
+	}
+
+	memcpy(entry->id, id, len);
+	entry->id_len = len;
+	entry->session = session;
+	entry->hash_next = buckets[hash_id(id, len)];
+	buckets[hash_id(id, len)] = entry;
+	lru_push(entry);
+	cache_count++;
+	evict_oldest();
+
+	/* The cache keeps the reference it was given */
+	return 1;
+}
+
+static SSL_SESSION *get_session_cb(SSL *ssl, const unsigned char *id, int len, int *copy) {
+	cache_entry **e;
+	(void)ssl;
+
+	*copy = 0;
+
+	if(len <= 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+		return NULL;
+	}
+
+	e = find_entry(id, (unsigned int)len);
+
+	if(e == NULL) {
+		return NULL;
+	}
+
+	lru_unlink(*e);
+	lru_push(*e);
+	/* OpenSSL takes its own reference */
+	*copy = 1;
+	return (*e)->session;
+}
+
+static void remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session) {
+	const unsigned char *id;
+	unsigned int len;
+	cache_entry **e;
+	(void)ctx;
+
+	id = SSL_SESSION_get_id(session, &len);
+	e = find_entry(id, len);
+
+	if(e != NULL && (*e)->session == session) {
+		drop_entry(e);
+	}
+}
+
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[TICKET_NAME_LENGTH], unsigned char *iv,
+                         EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *hmac_ctx, int enc) {
+	OSSL_PARAM params[3];
+	const ticket_key *key = NULL;
+	int i;
+	(void)ssl;
+
+	if(enc) {
+		if(ticket_key_count == 0) {
+			return 0; /* No ticket */
+		}
+
+		key = &ticket_keys[0];
+		i = 0;
+		memcpy(key_name, key->name, TICKET_NAME_LENGTH);
+
+		if(RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1
+		        || EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1) {
+			return -1;
+		}
+	} else {
+		for(i = 0; i < ticket_key_count; i++) {
+			if(memcmp(key_name, ticket_keys[i].name, TICKET_NAME_LENGTH) == 0) {
+				key = &ticket_keys[i];
+				break;
+			}
+		}
+
+		if(key == NULL) {
+			return 0; /* Unknown or retired key, full handshake */
+		}
+
+		if(EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1) {
+			return -1;
+		}
+	}
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)key->hmac_key, TICKET_KEY_LENGTH);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	if(EVP_MAC_CTX_set_params(hmac_ctx, params) != 1) {
+		return -1;
+	}
+
+	/* Ask for a ticket with the current key when an older one was used */
+	return i == 0 ? 1 : 2;
+}
+
+static void info_cb(const SSL *ssl, int where, int ret) {
+	SSL *s = (SSL *)ssl;
+	(void)ret;
+
+	/* May be signalled again after the handshake, e.g. for TLS 1.3 tickets */
+	if((where & SSL_CB_HANDSHAKE_DONE) && SSL_get_ex_data(s, counted_index) == NULL) {
+		SSL_set_ex_data(s, counted_index, s);
+		handshakes[SSL_is_server(s) ? 1 : 0][SSL_session_reused(s) ? 1 : 0]++;
+#ifndef OPENSSL_NO_KTLS
+
+		if(BIO_get_ktls_send(SSL_get_wbio(s))) {
+			ktls_send++;
+		}
+
+		if(BIO_get_ktls_recv(SSL_get_rbio(s))) {
+			ktls_recv++;
+		}
+
+#endif
+	}
+}
+
+static SSL_CTX *check_context(lua_State *L, int idx) {
+	SSL_CTX **ctx = luaL_checkudata(L, idx, LUASEC_CONTEXT);
+	luaL_argcheck(L, *ctx != NULL, idx, "invalid context");
+	return *ctx;
+}
+
+static int get_boolean_field(lua_State *L, int idx, const char *name, int def) {
+	int value;
+	lua_getfield(L, idx, name);
+	value = lua_isnil(L, -1) ? def : lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+/*
+ * ok, err = tlscache.configure(ctx, { id = string, server = boolean, cache = boolean, tickets = boolean, timeout = seconds, ktls = boolean })
+ */
+static int Lconfigure(lua_State *L) {
+	SSL_CTX *ctx = check_context(L, 1);
+	size_t id_len;
+	const char *id;
+	int server;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "id");
+	id = luaL_optlstring(L, -1, "prosody", &id_len);
+	luaL_argcheck(L, id_len <= SSL_MAX_SID_CTX_LENGTH, 2, "session id context too long");
+	server = get_boolean_field(L, 2, "server", 1);
+
+	if(SSL_CTX_get_info_callback(ctx) == NULL) {
+		SSL_CTX_set_info_callback(ctx, info_cb);
+	}
+
+	if(get_boolean_field(L, 2, "ktls", 0)) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+		luaL_pushfail(L);
+		lua_pushliteral(L, "kTLS is not supported by this OpenSSL");
+		return 2;
+#endif
+	}
+
+	if(!server) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if(SSL_CTX_set_session_id_context(ctx, (const unsigned char *)id, (unsigned int)id_len) != 1) {
+		luaL_pushfail(L);
+		lua_pushliteral(L, "could not set session id context");
+		return 2;
+	}
+
+	lua_getfield(L, 2, "timeout");
+
+	if(!lua_isnil(L, -1)) {
+		SSL_CTX_set_timeout(ctx, (long)luaL_checkinteger(L, -1));
+	}
+
+	if(get_boolean_field(L, 2, "cache", 1)) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+		SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+		SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+
+	if(get_boolean_field(L, 2, "tickets", 1)) {
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+		if(SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb) != 1) {
+			luaL_pushfail(L);
+			lua_pushliteral(L, "could not set session ticket callback");
+			return 2;
+		}
+	} else {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * tlscache.set_size(sessions)
+ * Zero disables caching and empties the cache.
+ */
+static int Lset_size(lua_State *L) {
+	lua_Integer size = luaL_checkinteger(L, 1);
+	size_t new_count = 1;
+	cache_entry **new_buckets, *e;
+
+	luaL_argcheck(L, size >= 0, 1, "size must not be negative");
+	cache_capacity = (size_t)size;
+	evict_oldest();
+
+	while(new_count < cache_capacity) {
+		new_count <<= 1;
+	}
+
+	if(new_count == bucket_count) {
+		return 0;
+	}
+
+	new_buckets = calloc(new_count, sizeof(cache_entry *));
+
+	if(new_buckets == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+
+	free(buckets);
+	buckets = new_buckets;
+	bucket_count = new_count;
+
+	for(e = oldest; e != NULL; e = e->newer) {
+		size_t h = hash_id(e->id, e->id_len);
+		e->hash_next = buckets[h];
+		buckets[h] = e;
+	}
+
+	return 0;
+}
+
+/*
+ * ok, err = tlscache.rotate_ticket_keys()
+ */
+static int Lrotate_ticket_keys(lua_State *L) {
+	ticket_key key;
+
+	if(RAND_bytes(key.name, sizeof(key.name)) != 1
+	        || RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1
+	        || RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+		luaL_pushfail(L);
+		lua_pushliteral(L, "could not generate session ticket key");
+		return 2;
+	}
+
+	memmove(&ticket_keys[1], &ticket_keys[0], sizeof(ticket_key) * (TICKET_KEYS - 1));
+	ticket_keys[0] = key;
+
+	if(ticket_key_count < TICKET_KEYS) {
+		ticket_key_count++;
+	}
+
+	OPENSSL_cleanse(&key, sizeof(key));
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * tlscache.clear_ticket_keys()
+ * Stops issuing tickets and makes existing ones useless.
+ */
+static int Lclear_ticket_keys(lua_State *L) {
+	(void)L;
+	OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
+	ticket_key_count = 0;
+	return 0;
+}
+
+static int Lstats(lua_State *L) {
+	lua_createtable(L, 0, 10);
+	lua_pushinteger(L, (lua_Integer)cache_count);
+	lua_setfield(L, -2, "cached");
+	lua_pushinteger(L, (lua_Integer)cache_capacity);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, cache_evictions);
+	lua_setfield(L, -2, "evictions");
+	lua_pushinteger(L, ticket_key_count);
+	lua_setfield(L, -2, "ticket_keys");
+	lua_pushinteger(L, handshakes[1][0]);
+	lua_setfield(L, -2, "server_full");
+	lua_pushinteger(L, handshakes[1][1]);
+	lua_setfield(L, -2, "server_resumed");
+	lua_pushinteger(L, handshakes[0][0]);
+	lua_setfield(L, -2, "client_full");
+	lua_pushinteger(L, handshakes[0][1]);
+	lua_setfield(L, -2, "client_resumed");
+	lua_pushinteger(L, ktls_send);
+	lua_setfield(L, -2, "ktls_send");
+	lua_pushinteger(L, ktls_recv);
+	lua_setfield(L, -2, "ktls_recv");
+	return 1;
+}
+
+static const luaL_Reg Reg[] = {
+	{ "configure",		Lconfigure		},
+	{ "set_size",		Lset_size		},
+	{ "rotate_ticket_keys",	Lrotate_ticket_keys	},
+	{ "clear_ticket_keys",	Lclear_ticket_keys	},
+	{ "stats",		Lstats			},
+	{ NULL,			NULL			}
+};
+
+LUALIB_API int luaopen_prosody_util_tlscache(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(counted_index == -1) {
+		counted_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	}
+
+	lua_newtable(L);
+	luaL_setfuncs(L, Reg, 0);
+#ifdef SSL_OP_ENABLE_KTLS
+	lua_pushboolean(L, 1);
+#else
+	lua_pushboolean(L, 0);
+#endif
+	lua_setfield(L, -2, "have_ktls");
+	return 1;
+}
+
+LUALIB_API int luaopen_util_tlscache(lua_State *L) {
+	return luaopen_prosody_util_tlscache(L);
+}
@@ -26,6 +26,7 @@ local t_concat = table.concat;
 local envloadfile = require"prosody.util.envload".envloadfile;
 local envload = require"prosody.util.envload".envload;
 local serialize = require "prosody.util.serialization".serialize;
+local async_ready = require "prosody.util.async".ready;
 local lfs = require "lfs";
 -- Extract directory separator from package.config (an undocumented string that comes with lua)
 local path_separator = assert ( package.config:match ( "^([^\n]+)" ) , "package.config not in standard form" )
@@ -94,6 +95,7 @@ end
 
 local data_path = (prosody and prosody.paths and prosody.paths.data) or ".";
 local callbacks = {};
+local async_io; -- util.fileio pool, used for whole-file operations from async threads
 
 ------- API -------------
 
@@ -102,6 +104,23 @@ local function set_data_path(path)
 	data_path = path;
 end
 
+local function set_async_io(io)
+	log("debug", "%s asynchronous file I/O", io and "Enabling" or "Disabling");
+	async_io = io;
+end
+
+-- Like envloadfile(), but reading the file off the main thread when possible
+local function loadfile(filename, env)
+	if not (async_io and async_ready()) then
+		return envloadfile(filename, env);
+	end
+	local content, err, errno = async_io:read(filename);
+	if not content then
+		return content, err, errno;
+	end
+	return envload(content, "@" .. filename, env);
+end
+
 local function callback(username, host, datastore, data)
 	for _, f in ipairs(callbacks) do
 		username, host, datastore, data = f(username, host, datastore, data);
@@ -144,7 +163,7 @@ local function getpath(username, host, datastore, ext, create)
 end
 
 local function load(username, host, datastore)
-	local data, err, errno = envloadfile(getpath(username, host, datastore), {});
+	local data, err, errno = loadfile(getpath(username, host, datastore), {});
 	if not data then
 		if errno == ENOENT then
 			-- No such file, ok to ignore
@@ -162,7 +181,56 @@ local function load(username, host, datastore)
 	return ret;
 end
 
+-- Returns a table of username -> data for users that have any
+local function load_many(usernames, host, datastore)
+	local results = {};
+	if not (async_io and async_ready()) then
+		for _, username in ipairs(usernames) do
+			local data, err = load(username, host, datastore);
+			if data == nil and err then
+				return nil, err;
+			end
+			results[username] = data;
+		end
+		return results;
+	end
+
+	-- Read all the files in parallel
+	local filenames = {};
+	for i, username in ipairs(usernames) do
+		filenames[i] = getpath(username, host, datastore);
+	end
+	local contents, errors, errnos = async_io:read_many(filenames);
+	for i, username in ipairs(usernames) do
+		local content = contents[i];
+		if content then
+			local data, err = envload(content, "@" .. filenames[i], {});
+			local success, ret = false, err;
+			if data then
+				success, ret = pcall(data);
+			end
+			if not success then
+				log("error", "Unable to load %s storage ('%s') for user: %s@%s", datastore, ret, username, host or "nil");
+				return nil, "Error reading storage";
+			end
+			results[username] = ret;
+		elseif errnos[i] ~= ENOENT then
+			log("error", "Failed to load %s storage ('%s') for user: %s@%s", datastore, errors[i], username, host or "nil");
+			return nil, "Error reading storage";
+		end
+	end
+	return results;
+end
+
 local function atomic_store(filename, data)
+	if async_io and async_ready() then
+		-- Without fsync, same as below. The I/O threads give the scratch file
+		-- a unique name, since they may be storing the same file concurrently.
+		return async_io:store(filename, data, false);
+	end
+
+	-- Nothing else writes files while this runs, so the name can be fixed
+	-- and a scratch file left behind by a crash gets reused
 	local scratch = filename.."~";
 	local f, ok, msg, errno; -- luacheck: ignore errno
 	-- TODO return util.error with code=errno?
@@ -185,7 +253,12 @@ local function atomic_store(filename, data)
 		return nil, msg;
 	end
 
-	return os_rename(scratch, filename);
+	ok, msg = os_rename(scratch, filename);
+	if not ok then
+		os_remove(scratch);
+		return nil, msg;
+	end
+	return ok;
 end
 
 if prosody and prosody.platform ~= "posix" then
@@ -489,7 +562,7 @@ local indexed_list_mt = {
 
 local function list_load(username, host, datastore)
 	local items = {};
-	local data, err, errno = envloadfile(getpath(username, host, datastore, "list"), {item = function(i) t_insert(items, i); end});
+	local data, err, errno = loadfile(getpath(username, host, datastore, "list"), {item = function(i) t_insert(items, i); end});
 	if not data then
 		if errno == ENOENT then
 			-- No such file, ok to ignore
@@ -711,10 +784,12 @@ end
 
 return {
 	set_data_path = set_data_path;
+	set_async_io = set_async_io;
 	add_callback = add_callback;
 	remove_callback = remove_callback;
 	getpath = getpath;
 	load = load;
+	load_many = load_many;
 	store = store;
 	append_raw = append;
 	store_raw = atomic_store;
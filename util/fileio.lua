@@ -0,0 +1,133 @@
+-- Prosody IM
+-- Copyright (C) 2026 Prosody contributors
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+
+-- Blocking file operations (and PBKDF2) run on the util.aio thread pool,
+-- suspending the calling util.async thread until they complete.
+
+local aio = require "prosody.util.aio";
+local async = require "prosody.util.async";
+local log = require "prosody.util.logger".init("fileio");
+
+local ipairs = ipairs;
+local setmetatable = setmetatable;
+
+local _ENV = nil;
+-- luacheck: std none
+
+local pool_mt = {};
+pool_mt.__index = pool_mt;
+
+local function dispatch(self)
+	local waiting = self.waiting;
+	for id, ok, ret, errno in self.pool:completed() do
+		local callback = waiting[id];
+		if callback then
+			waiting[id] = nil;
+			callback(ok, ret, errno);
+		else
+			log("warn", "Completed unknown file operation %d", id);
+		end
+	end
+end
+
+-- watchfd is the function of the same name from net.server, passed in
+-- rather than required so that this library stays usable outside Prosody
+local function new(threads, watchfd)
+	local pool, err = aio.new(threads);
+	if not pool then
+		return nil, err;
+	end
+	local self = setmetatable({ pool = pool; waiting = {} }, pool_mt);
+	self.watcher = watchfd(pool:getfd(), function ()
+		dispatch(self);
+	end);
+	return self;
+end
+
+function pool_mt:wait_for(id, err, errno)
+	if not id then
+		return nil, err, errno;
+	end
+	local wait, done = async.waiter();
+	local ok, ret, ret_errno;
+	self.waiting[id] = function (...)
+		ok, ret, ret_errno = ...;
+		done();
+	end
+	wait();
+	if not ok then
+		return nil, ret, ret_errno;
+	end
+	return ret or true;
+end
+
+-- Returns the contents of the file, or nil, error message, errno
+function pool_mt:read(filename)
+	return self:wait_for(self.pool:read(filename));
+end
+
+-- Reads several files in parallel, returning tables of contents, error
+-- messages and errno values indexed like the list of filenames
+function pool_mt:read_many(filenames)
+	local contents, errors, errnos = {}, {}, {};
+	local wait, done = async.waiter(#filenames);
+	for i, filename in ipairs(filenames) do
+		local id, err, errno = self.pool:read(filename);
+		if id then
+			self.waiting[id] = function (ok, ret, ret_errno)
+				if ok then
+					contents[i] = ret;
+				else
+					errors[i], errnos[i] = ret, ret_errno;
+				end
+				done();
+			end
+		else
+			errors[i], errnos[i] = err, errno;
+			done();
+		end
+	end
+	wait();
+	return contents, errors, errnos;
+end
+
+-- Atomically replaces the file via a scratch file, with fsync unless 'sync' is false
+function pool_mt:store(filename, data, sync)
+	return self:wait_for(self.pool:store(filename, data, sync));
+end
+
+function pool_mt:fsync(filename)
+	return self:wait_for(self.pool:fsync(filename));
+end
+
+function pool_mt:rename(from, to)
+	return self:wait_for(self.pool:rename(from, to));
+end
+
+function pool_mt:remove(filename)
+	return self:wait_for(self.pool:remove(filename));
+end
+
+-- Returns the PBKDF2 derived key, as long as the digest
+function pool_mt:pbkdf2(digest, password, salt, iterations)
+	return self:wait_for(self.pool:pbkdf2(digest, password, salt, iterations));
+end
+
+function pool_mt:stats()
+	return self.pool:stats();
+end
+
+function pool_mt:close()
+	-- Finishes queued operations and resumes anything still waiting on them
+	self.pool:close();
+	dispatch(self);
+	self.watcher:close();
+end
+
+return {
+	new = new;
+};
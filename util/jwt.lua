@@ -47,12 +47,22 @@ end
 local function new_hmac_algorithm(name)
 	local static_header = new_static_header(name);
 
-	local hmac = hashes["hmac_sha"..name:sub(-3)];
+	local digest = "sha"..name:sub(-3);
+	local hmac = hashes["hmac_"..digest];
+
+	-- Keys from load_key() are reusable keyed hashers, but plain strings are
+	-- still accepted by sign() and verify()
+	local function sign_with(key, signed)
+		if type(key) == "string" then
+			return hmac(key, signed);
+		end
+		return key:digest(signed);
+	end
 
 	local function sign(key, payload)
 		local encoded_payload = json.encode(payload);
 		local signed = static_header .. b64url(encoded_payload);
-		local signature = hmac(key, signed);
+		local signature = sign_with(key, signed);
 		return signed .. "." .. b64url(signature);
 	end
 
@@ -60,7 +70,7 @@ local function new_hmac_algorithm(name)
 		local signed, signature, raw_payload = decode_jwt(blob, name);
 		if not signed then return nil, signature; end -- nil, err
 
-		if not secure_equals(b64url(hmac(key, signed)), signature) then
+		if not secure_equals(b64url(sign_with(key, signed)), signature) then
 			return false, "signature-mismatch";
 		end
 
@@ -69,7 +79,7 @@ local function new_hmac_algorithm(name)
 
 	local function load_key(key)
 		assert(type(key) == "string", "key must be string (long, random, secure)");
-		return key;
+		return hashes.new(digest, key);
 	end
 
 	return { sign = sign, verify = verify, load_key = load_key };
@@ -180,14 +180,24 @@ local function new(config)
 		events = events.new();
 	}, service_mt);
 
+	-- Item stores of persistent nodes are opened when first needed
+	setmetatable(service.data, {
+		__index = function (data, node_name)
+			local node = service.nodes[node_name];
+			if not (node and node.config.persist_items) then
+				return nil;
+			end
+			local itemstore = service.config.itemstore(node.config, node_name);
+			data[node_name] = itemstore;
+			return itemstore;
+		end;
+	});
+
 	-- Load nodes from storage, if we have a store and it supports iterating over stored items
 	if config.nodestore and config.nodestore.users then
 		for node_name in config.nodestore:users() do
 			local node = load_node_from_store(service, node_name);
 			service.nodes[node_name] = node;
-			if node.config.persist_items then
-				service.data[node_name] = config.itemstore(service.nodes[node_name].config, node_name);
-			end
 
 			for jid in pairs(service.nodes[node_name].subscribers) do
 				local normal_jid = service.config.normalize_jid(jid);
@@ -298,6 +308,8 @@ function service:set_affiliation(node, actor, jid, affiliation) --> ok, err
 		end
 	end
 
+	self.events.fire_event("affiliation-changed", { service = self, node = node, actor = actor, jid = jid, affiliation = affiliation });
+
 	local _, jid_sub = self:get_subscription(node, true, jid);
 	if not jid_sub and not self:may(node, jid, "be_unsubscribed") then
 		local ok, err = self:add_subscription(node, true, jid);
@@ -502,9 +514,12 @@ function service:delete(node, actor) --> ok, err
 	if not node_obj then
 		return false, "item-not-found";
 	end
+	-- Open the item store while the node still exists, so that it is cleared
+	-- even if it was never used
+	local itemstore = self.data[node];
 	self.nodes[node] = nil;
-	if self.data[node] and self.data[node].clear then
-		self.data[node]:clear();
+	if itemstore and itemstore.clear then
+		itemstore:clear();
 	end
 	self.data[node] = nil;
 
@@ -658,11 +673,15 @@ function service:get_items(node, actor, ids, resultspec) --> (true, { id, [id] =
 		-- Disabled rather than unsupported, but close enough.
 		return false, "persistent-items-unsupported";
 	end
+	-- resultspec may contain RSM after and before (true for the last page),
+	-- relative to the order of items() which is newest first
 	if type(ids) == "string" then -- COMPAT see #1305
 		ids = { ids };
 	end
 	local data = {};
 	local limit = resultspec and resultspec.max;
+	local store = self.data[node];
+	local after, before = resultspec and resultspec.after, resultspec and resultspec.before;
 	if ids then
 		for _, key in ipairs(ids) do
 			local value = self.data[node]:get(key);
@@ -673,8 +692,31 @@ function service:get_items(node, actor, ids, resultspec) --> (true, { id, [id] =
 				if limit and #data >= limit then break end
 			end
 		end
+	elseif (after or before) and not store.paged then
+		-- Paging through a store that can't do it by itself
+		local page, skipping = {}, after ~= nil;
+		for key, value in store:items() do
+			if key == before then break; end
+			if not skipping then
+				page[#page+1] = key;
+				page[key] = value;
+			end
+			if key == after then skipping = false; end
+		end
+		local first = 1;
+		if before and limit and #page > limit then
+			-- The page right before the anchor
+			first = #page - limit + 1;
+		end
+		for i = first, #page do
+			local key = page[i];
+			data[#data+1] = key;
+			data[key] = page[key];
+			if limit and #data >= limit then break end
+		end
 	else
-		for key, value in self.data[node]:items() do
+		-- Paged stores take care of anchors and limits themselves
+		for key, value in store:items(resultspec) do
 			data[#data+1] = key;
 			data[key] = value;
 			if limit and #data >= limit then break
@@ -808,6 +850,9 @@ function service:set_node_config(node, actor, new_config) --> ok, err
 	end
 
 	local old_config = node_obj.config;
+	-- Open the item store under the old config, so that it can be cleared if
+	-- the node stops persisting items
+	local itemstore = self.data[node];
 	node_obj.config = new_config;
 
 	if self.config.nodestore then
@@ -819,6 +864,8 @@ function service:set_node_config(node, actor, new_config) --> ok, err
 		end
 	end
 
+	self.events.fire_event("node-config-changed", { service = self, node = node, actor = actor, config = new_config });
+
 	if old_config["access_model"] ~= node_obj.config["access_model"] then
 		for subscriber in pairs(node_obj.subscribers) do
 			if not self:may(node, subscriber, "be_subscribed") then
@@ -834,9 +881,9 @@ function service:set_node_config(node, actor, new_config) --> ok, err
 	if old_config["persist_items"] ~= node_obj.config["persist_items"] then
 		if node_obj.config["persist_items"] then
 			self.data[node] = self.config.itemstore(self.nodes[node].config, node);
-		elseif self.data[node] then
-			if self.data[node].clear then
-				self.data[node]:clear()
+		elseif itemstore then
+			if itemstore.clear then
+				itemstore:clear()
 			end
 			self.data[node] = nil;
 		end
@@ -13,6 +13,9 @@
 
 local s_match = string.match;
 local type = type
+local async = require "prosody.util.async";
+local cache = require "prosody.util.cache";
+local random = require "prosody.util.random";
 local base64 = require "prosody.util.encodings".base64;
 local hashes = require "prosody.util.hashes";
 local generate_uuid = require "prosody.util.uuid".generate;
@@ -43,6 +46,28 @@ Supported Channel Binding Backends
 
 local default_i = 10000
 
+-- util.fileio pool that runs PBKDF2 off the main thread, when set
+local kdf_pool;
+
+-- Recently derived keys, so that e.g. clients repeatedly logging in with
+-- PLAIN don't pay for PBKDF2 every time. Keyed by a MAC of the inputs, where
+-- the salt changes with every password change, so no plain text passwords
+-- are kept around.
+local derived_keys = cache.new(1000);
+local derived_key_mac = hashes.new("sha256", random.bytes(32));
+
+local function set_kdf_pool(pool)
+	kdf_pool = pool;
+end
+
+local function set_cache_size(size)
+	if size > 0 then
+		derived_keys = cache.new(size);
+	else
+		derived_keys = nil;
+	end
+end
+
 local function validate_username(username, _nodeprep)
 	-- check for forbidden char sequences
 	for eq in username:gmatch("=(.?.?)") do
@@ -69,7 +94,8 @@ local function hashprep(hashname)
 	return hashname:lower():gsub("-", "_");
 end
 
-local function get_scram_hasher(H, HMAC, Hi)
+-- 'digest' names the hash for util.aio, when PBKDF2 may be run on the pool
+local function get_scram_hasher(H, HMAC, Hi, digest)
 	return function (password, salt, iteration_count)
 		if type(password) ~= "string" or type(salt) ~= "string" or type(iteration_count) ~= "number" then
 			return false, "inappropriate argument types"
@@ -81,9 +107,28 @@ local function get_scram_hasher(H, HMAC, Hi)
 		if not password then
 			return false, "password fails SASLprep";
 		end
-		local salted_password = Hi(password, salt, iteration_count);
+		local cache_key;
+		if derived_keys then
+			cache_key = derived_key_mac:digest(("%s:%d:%d:%s:%s"):format(digest or "", iteration_count, #salt, salt, password));
+			local cached = derived_keys:get(cache_key);
+			if cached then
+				return true, cached[1], cached[2];
+			end
+		end
+		local salted_password;
+		if kdf_pool and digest and async.ready() then
+			local err;
+			salted_password, err = kdf_pool:pbkdf2(digest, password, salt, iteration_count);
+			if not salted_password then
+				log("warn", "Falling back to PBKDF2 on the main thread: %s", err);
+			end
+		end
+		salted_password = salted_password or Hi(password, salt, iteration_count);
 		local stored_key = H(HMAC(salted_password, "Client Key"))
 		local server_key = HMAC(salted_password, "Server Key");
+		if cache_key and derived_keys then
+			derived_keys:set(cache_key, { stored_key, server_key });
+		end
 		return true, stored_key, server_key
 	end
 end
@@ -229,8 +274,8 @@ end
 
 local auth_db_getters = {}
 local function init(registerMechanism)
-	local function registerSCRAMMechanism(hash_name, hash, hmac_hash, pbkdf2)
-		local get_auth_db = get_scram_hasher(hash, hmac_hash, pbkdf2);
+	local function registerSCRAMMechanism(hash_name, hash, hmac_hash, pbkdf2, digest)
+		local get_auth_db = get_scram_hasher(hash, hmac_hash, pbkdf2, digest);
 		auth_db_getters[hash_name] = get_auth_db;
 		registerMechanism("SCRAM-"..hash_name,
 			{"plain", "scram_"..(hashprep(hash_name))},
@@ -242,13 +287,15 @@ local function init(registerMechanism)
 			scram_gen(hash_name:lower(), hash, hmac_hash, get_auth_db, true), {"tls-unique", "tls-exporter"});
 	end
 
-	registerSCRAMMechanism("SHA-1", hashes.sha1, hashes.hmac_sha1, hashes.pbkdf2_hmac_sha1);
-	registerSCRAMMechanism("SHA-256", hashes.sha256, hashes.hmac_sha256, hashes.pbkdf2_hmac_sha256);
+	registerSCRAMMechanism("SHA-1", hashes.sha1, hashes.hmac_sha1, hashes.pbkdf2_hmac_sha1, "sha1");
+	registerSCRAMMechanism("SHA-256", hashes.sha256, hashes.hmac_sha256, hashes.pbkdf2_hmac_sha256, "sha256");
 end
 
 return {
 	get_hash = get_scram_hasher;
 	hashers = auth_db_getters;
-	getAuthenticationDatabaseSHA1 = get_scram_hasher(hashes.sha1, hashes.hmac_sha1, hashes.pbkdf2_hmac_sha1); -- COMPAT
+	getAuthenticationDatabaseSHA1 = get_scram_hasher(hashes.sha1, hashes.hmac_sha1, hashes.pbkdf2_hmac_sha1, "sha1"); -- COMPAT
 	init = init;
+	set_kdf_pool = set_kdf_pool;
+	set_cache_size = set_cache_size;
 }
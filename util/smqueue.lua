@@ -38,6 +38,19 @@ function smqueue:resume() return self._queue:items() end
 
 function smqueue:consume() return self._queue:consume() end
 
+function smqueue:spill()
+	local items = {};
+	for v in self._queue:consume() do table.insert(items, v); end
+	return items
+end
+
+function smqueue:restore(items)
+	local q = queue.new(self._queue.size, true);
+	for _, v in ipairs(items) do assert(q:push(v)); end
+	for v in self._queue:consume() do assert(q:push(v)); end
+	self._queue = q;
+end
+
 function smqueue:table()
 	local t = {};
 	for i, v in self:resume() do t[i] = v; end
@@ -48,9 +61,9 @@ local function freeze(q) return { head = q._head; tail = q._tail } end
 
 local queue_mt = { __name = "smqueue"; __index = smqueue; __len = smqueue.count_unacked; __freeze = freeze }
 
-function lib.new(size)
+function lib.new(size, head, tail)
 	assert(size > 0);
-	return setmetatable({ _head = 0; _tail = 0; _queue = queue.new(size, true) }, queue_mt)
+	return setmetatable({ _head = head or 0; _tail = tail or 0; _queue = queue.new(size, true) }, queue_mt)
 end
 
 return lib
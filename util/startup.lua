@@ -447,6 +447,56 @@ end
 
 function startup.init_data_store()
 	require "prosody.core.storagemanager";
+
+	local io_threads = config.get("*", "storage_io_threads");
+	if io_threads and prosody.platform == "posix" then
+		local have_fileio, fileio = pcall(require, "prosody.util.fileio");
+		if not have_fileio then
+			log("warn", "Asynchronous file I/O is unavailable: %s", fileio);
+			return;
+		end
+		local pool, err = fileio.new(io_threads, server.watchfd);
+		if not pool then
+			log("error", "Could not start file I/O threads: %s", err);
+			return;
+		end
+		local datamanager = require "prosody.util.datamanager";
+		datamanager.set_async_io(pool);
+		prosody.events.add_handler("server-cleanup", function ()
+			datamanager.set_async_io(nil);
+			pool:close();
+		end);
+	end
+end
+
+-- PBKDF2 for SCRAM and hashed password checks is run on a thread pool so
+-- that a burst of logins doesn't stall everything else
+function startup.init_password_hashing()
+	local scram = require "prosody.util.sasl.scram";
+	scram.set_cache_size(config.get("*", "password_hash_cache_size") or 1000);
+
+	local threads = config.get("*", "password_hashing_threads");
+	if threads == nil then
+		threads = 2;
+	end
+	if threads == false or threads == 0 or prosody.platform ~= "posix" then
+		return;
+	end
+	local have_fileio, fileio = pcall(require, "prosody.util.fileio");
+	if not have_fileio then
+		log("debug", "Password hashing threads are unavailable: %s", fileio);
+		return;
+	end
+	local pool, err = fileio.new(threads, server.watchfd);
+	if not pool then
+		log("error", "Could not start password hashing threads: %s", err);
+		return;
+	end
+	scram.set_kdf_pool(pool);
+	prosody.events.add_handler("server-cleanup", function ()
+		scram.set_kdf_pool(nil);
+		pool:close();
+	end);
 end
 
 local running_state = require "prosody.util.fsm".new({
@@ -944,9 +994,11 @@ function startup.prosody()
 	startup.init_async();
 	startup.instrument();
 	startup.init_http_client();
-	startup.init_data_store();
 	startup.init_global_protection();
 	startup.posix_daemonize();
+	-- Worker threads are not inherited by the daemonized child
+	startup.init_data_store();
+	startup.init_password_hashing();
 	startup.write_pidfile();
 	startup.hook_posix_signals();
 	startup.notification_socket();